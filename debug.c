@@ -277,7 +277,7 @@ int __init dbg_init(void)
 	return 0;
 }
 
-void __exit dbg_cleanup(void)
+void dbg_cleanup(void)
 {
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
 	proc_net_remove("dsr_dbg");
@@ -89,7 +89,7 @@ int trace(const char *func, const char *fmt, ...);
 
 #ifdef __KERNEL__
 int __init dbg_init(void);
-void __exit dbg_cleanup(void);
+void dbg_cleanup(void);
 #endif
 
 #endif				/* _DEBUG_H */
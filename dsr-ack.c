@@ -21,6 +21,47 @@
 #include "link-cache.h"
 #include "neigh.h"
 #include "maint-buf.h"
+#include "timer.h"
+#include "timer-wheel.h"
+#include "dsr-io.h"
+
+#define ACK_TBL_MAX_LEN 64
+
+#ifdef __KERNEL__
+#define ACK_TBL_PROC_NAME "dsr_ack_tbl"
+static TBL(ack_tbl, ACK_TBL_MAX_LEN);
+static struct tw_timer ack_tbl_timer;
+static struct ack_tbl_stats ack_stats;
+#endif
+
+/* An ACK held back so that later ACKs to the same neighbor can be combined
+ * with it, or so that it can be piggybacked on a packet going there */
+struct ack_entry {
+	list_t l;
+	struct in_addr neigh;
+	unsigned short id;
+	struct timeval expires;
+};
+
+static inline int crit_neigh(void *pos, void *data)
+{
+	struct ack_entry *e = (struct ack_entry *)pos;
+	struct in_addr *neigh = (struct in_addr *)data;
+
+	if (e->neigh.s_addr == neigh->s_addr)
+		return 1;
+	return 0;
+}
+
+static inline int crit_expires(void *pos, void *data)
+{
+	struct ack_entry *e = (struct ack_entry *)pos;
+	struct ack_entry *n = (struct ack_entry *)data;
+
+	if (timeval_diff(&e->expires, &n->expires) > 0)
+		return 1;
+	return 0;
+}
 
 struct dsr_ack_opt *dsr_ack_opt_add(char *buf, int len, struct in_addr src,
 				    struct in_addr dst, unsigned short id)
@@ -106,6 +147,8 @@ int NSCLASS dsr_ack_send(struct in_addr dst, unsigned short id)
 
 	dp->flags |= PKT_XMIT_JITTER;
 
+	ack_stats.sent++;
+
 	XMIT(dp);
 
 	return 1;
@@ -131,21 +174,13 @@ static struct dsr_ack_req_opt *dsr_ack_req_opt_create(char *buf, int len,
 	return ack_req;
 }
 
-struct dsr_ack_req_opt *NSCLASS
-dsr_ack_req_opt_add(struct dsr_pkt *dp, unsigned short id)
+/* Make room for an option of length len at the end of the DSR options of a
+ * packet, adding an options header if the packet does not have one */
+char *NSCLASS dsr_ack_opt_space(struct dsr_pkt *dp, int len)
 {
 	char *buf = NULL;
 	int prot = 0, tot_len = 0, ttl = IPDEFTTL;
 
-	if (!dp)
-		return NULL;
-
-	/* If we are forwarding a packet and there is already an ACK REQ option,
-	 * we just overwrite the old one. */
-	if (dp->ack_req_opt) {
-		buf = (char *)dp->ack_req_opt;
-		goto end;
-	}
 #ifdef NS2
 	if (dp->p) {
 		hdr_cmn *cmh = HDR_CMN(dp->p);
@@ -163,20 +198,16 @@ dsr_ack_req_opt_add(struct dsr_pkt *dp, unsigned short id)
 #endif
 	if (!dsr_pkt_opts_len(dp)) {
 
-		buf =
-		    dsr_pkt_alloc_opts(dp,
-				       DSR_OPT_HDR_LEN + DSR_ACK_REQ_HDR_LEN);
-		LOG_DBG("Allocating options for ACK REQ\n");
+		buf = dsr_pkt_alloc_opts(dp, DSR_OPT_HDR_LEN + len);
+
+		LOG_DBG("Allocating options\n");
 		if (!buf)
 			return NULL;
 
 		dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
-			     tot_len + DSR_OPT_HDR_LEN + DSR_ACK_REQ_HDR_LEN,
-			     IPPROTO_DSR, ttl);
+			     tot_len + DSR_OPT_HDR_LEN + len, IPPROTO_DSR, ttl);
 
-		dp->dh.opth =
-		    dsr_opt_hdr_add(buf, DSR_OPT_HDR_LEN + DSR_ACK_REQ_HDR_LEN,
-				    prot);
+		dp->dh.opth = dsr_opt_hdr_add(buf, DSR_OPT_HDR_LEN + len, prot);
 
 		if (!dp->dh.opth) {
 			return NULL;
@@ -185,23 +216,46 @@ dsr_ack_req_opt_add(struct dsr_pkt *dp, unsigned short id)
 		buf += DSR_OPT_HDR_LEN;
 
 	} else {
-		buf = dsr_pkt_alloc_opts_expand(dp, DSR_ACK_REQ_HDR_LEN);
+		buf = dsr_pkt_alloc_opts_expand(dp, len);
 
-		LOG_DBG("Expanding options for ACK REQ p_len=%d\n",
+		LOG_DBG("Expanding options p_len=%d\n",
 		      ntohs(dp->dh.opth->p_len));
 		if (!buf)
 			return NULL;
 
 		dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
-			     tot_len + DSR_ACK_REQ_HDR_LEN, IPPROTO_DSR, ttl);
+			     tot_len + len, IPPROTO_DSR, ttl);
 
 		dp->dh.opth =
 		    dsr_opt_hdr_add(dp->dh.raw,
 				    DSR_OPT_HDR_LEN +
-				    ntohs(dp->dh.opth->p_len) +
-				    DSR_ACK_REQ_HDR_LEN, dp->dh.opth->nh);
+				    ntohs(dp->dh.opth->p_len) + len,
+				    dp->dh.opth->nh);
 	}
-	LOG_DBG("Added ACK REQ option id=%u\n", id, ntohs(dp->dh.opth->p_len));
+	return buf;
+}
+
+struct dsr_ack_req_opt *NSCLASS
+dsr_ack_req_opt_add(struct dsr_pkt *dp, unsigned short id)
+{
+	char *buf = NULL;
+
+	if (!dp)
+		return NULL;
+
+	/* If we are forwarding a packet and there is already an ACK REQ option,
+	 * we just overwrite the old one. */
+	if (dp->ack_req_opt) {
+		buf = (char *)dp->ack_req_opt;
+		goto end;
+	}
+
+	buf = dsr_ack_opt_space(dp, DSR_ACK_REQ_HDR_LEN);
+
+	if (!buf)
+		return NULL;
+
+	LOG_DBG("Added ACK REQ option id=%u\n", id);
       end:
 	return dsr_ack_req_opt_create(buf, DSR_ACK_REQ_HDR_LEN, id);
 }
@@ -277,7 +331,10 @@ int NSCLASS dsr_ack_req_opt_recv(struct dsr_pkt *dp, struct dsr_ack_req_opt *ack
 	LOG_DBG("src=%s prv=%s id=%u\n",
 		print_ip(dp->src), print_ip(dp->prv_hop), id);
 
-	dsr_ack_send(dp->prv_hop, id);
+	/* In a receive batch, the ACKs for a neighbor are sent as one once
+	 * the batch is done */
+	if (!dsr_rx_batch_ack(dp->prv_hop, id))
+		ack_tbl_add(dp->prv_hop, id);
 
 	return DSR_PKT_NONE;
 }
@@ -309,3 +366,240 @@ int NSCLASS dsr_ack_opt_recv(struct dsr_ack_opt *ack)
 	
 	return DSR_PKT_NONE;
 }
+
+void NSCLASS _ack_tbl_set_timeout(void)
+{
+	struct ack_entry *e;
+
+	if (TBL_EMPTY(&ack_tbl)) {
+		tw_timer_del(&ack_tbl_timer);
+		return;
+	}
+
+	e = (struct ack_entry *)TBL_FIRST(&ack_tbl);
+
+	tw_timer_set(&ack_tbl_timer, &e->expires);
+}
+
+void NSCLASS ack_tbl_timeout(unsigned long data)
+{
+	struct timeval now;
+	list_t expired, *pos, *tmp;
+
+	INIT_LIST_HEAD(&expired);
+
+	gettime(&now);
+
+	write_lock_bh(&ack_tbl.lock);
+
+	while (!TBL_EMPTY(&ack_tbl)) {
+		struct ack_entry *e = (struct ack_entry *)TBL_FIRST(&ack_tbl);
+
+		if (timeval_diff(&e->expires, &now) > 0)
+			break;
+
+		__tbl_detach(&ack_tbl, &e->l);
+		list_add_tail(&e->l, &expired);
+	}
+
+	_ack_tbl_set_timeout();
+
+	write_unlock_bh(&ack_tbl.lock);
+
+	/* No packet to piggyback on came by in time, so the ACKs are sent on
+	 * their own. This goes through the transmit path, which takes the
+	 * table lock. */
+	list_for_each_safe(pos, tmp, &expired) {
+		struct ack_entry *e = (struct ack_entry *)pos;
+
+		list_del(&e->l);
+		dsr_ack_send(e->neigh, e->id);
+		kfree(e);
+	}
+}
+
+/* Queue an ACK for a neighbor. ACKs are cumulative, so an ACK that is
+ * already pending for the neighbor is just updated with the newer ID. */
+int NSCLASS ack_tbl_add(struct in_addr neigh, unsigned short id)
+{
+	struct ack_entry *e;
+	int send_now = 0;
+
+	if (ConfVal(AckAggregationDelay) == 0)
+		return dsr_ack_send(neigh, id);
+
+	write_lock_bh(&ack_tbl.lock);
+
+	e = (struct ack_entry *)__tbl_find(&ack_tbl, &neigh, crit_neigh);
+
+	if (e) {
+		if (dsr_ack_id_after(id, e->id))
+			e->id = id;
+
+		ack_stats.coalesced++;
+		goto out;
+	}
+
+	e = (struct ack_entry *)kmalloc(sizeof(struct ack_entry), GFP_ATOMIC);
+
+	if (!e) {
+		send_now = 1;
+		goto out;
+	}
+
+	e->neigh = neigh;
+	e->id = id;
+	gettime(&e->expires);
+	timeval_add_usecs(&e->expires, ConfValToUsecs(AckAggregationDelay));
+
+	if (__tbl_add(&ack_tbl, &e->l, crit_expires) < 0) {
+		kfree(e);
+		send_now = 1;
+		goto out;
+	}
+
+	if (TBL_FIRST(&ack_tbl) == &e->l)
+		_ack_tbl_set_timeout();
+      out:
+	write_unlock_bh(&ack_tbl.lock);
+
+	if (send_now)
+		return dsr_ack_send(neigh, id);
+
+	return 1;
+}
+
+/* Called for unicast packets about to be transmitted. ACK options in a
+ * forwarded packet were meant for this node and are removed, and an ACK
+ * pending for the next hop is piggybacked instead of being sent on its
+ * own. */
+void NSCLASS dsr_ack_piggyback(struct dsr_pkt *dp)
+{
+	struct ack_entry *e;
+	struct dsr_ack_opt *ack_opt = NULL;
+	char *buf;
+
+	if (!dp || dp->nxt_hop.s_addr == DSR_BROADCAST)
+		return;
+
+	if (dp->num_ack_opts)
+		dsr_opt_del(dp, DSR_OPT_ACK);
+
+	write_lock_bh(&ack_tbl.lock);
+
+	e = (struct ack_entry *)__tbl_find_detach(&ack_tbl, &dp->nxt_hop,
+						  crit_neigh);
+	if (e)
+		_ack_tbl_set_timeout();
+
+	write_unlock_bh(&ack_tbl.lock);
+
+	if (!e)
+		return;
+
+	buf = dsr_ack_opt_space(dp, DSR_ACK_HDR_LEN);
+
+	if (buf) {
+		ack_opt = dsr_ack_opt_add(buf, DSR_ACK_HDR_LEN, my_addr(),
+					  dp->nxt_hop, e->id);
+
+		/* The options may have been moved */
+		dsr_opt_parse(dp);
+	}
+
+	if (ack_opt) {
+		LOG_DBG("Piggybacking ACK to %s id=%u\n",
+			print_ip(e->neigh), e->id);
+		ack_stats.piggybacked++;
+	} else
+		dsr_ack_send(e->neigh, e->id);
+
+	kfree(e);
+}
+
+#ifdef __KERNEL__
+static int ack_tbl_print(struct tbl *t, char *buf)
+{
+	list_t *pos;
+	int len = 0;
+	struct timeval now;
+
+	gettime(&now);
+
+	read_lock_bh(&t->lock);
+
+	len += sprintf(buf, "# %-15s %-6s %-8s\n", "Neighbor", "Id", "Expires");
+
+	list_for_each(pos, &t->head) {
+		struct ack_entry *e = (struct ack_entry *)pos;
+
+		len += sprintf(buf + len, "  %-15s %-6u %-8ld\n",
+			       print_ip(e->neigh), e->id,
+			       timeval_diff(&e->expires, &now));
+	}
+
+	len += sprintf(buf + len,
+		       "\nACKs sent         : %lu\n"
+		       "ACKs piggybacked  : %lu\n"
+		       "ACKs coalesced    : %lu\n",
+		       ack_stats.sent, ack_stats.piggybacked,
+		       ack_stats.coalesced);
+
+	read_unlock_bh(&t->lock);
+
+	return len;
+}
+
+static int
+ack_tbl_proc_info(char *buffer, char **start, off_t offset, int length, int *eof, void *data)
+{
+	int len;
+
+	len = ack_tbl_print(&ack_tbl, buffer);
+
+	*start = buffer + offset;
+	len -= offset;
+	if (len > length)
+		len = length;
+	else if (len < 0)
+		len = 0;
+	return len;
+}
+
+#endif				/* __KERNEL__ */
+
+int __init NSCLASS ack_tbl_init(void)
+{
+#ifdef __KERNEL__
+	struct proc_dir_entry *proc;
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
+#define proc_net init_net.proc_net
+#endif
+	proc = create_proc_read_entry(ACK_TBL_PROC_NAME, 0, proc_net, ack_tbl_proc_info, NULL);
+	
+	if (!proc)
+		return -1;
+#endif
+	INIT_TBL(&ack_tbl, ACK_TBL_MAX_LEN);
+
+	memset(&ack_stats, 0, sizeof(struct ack_tbl_stats));
+
+	tw_timer_init(&ack_tbl_timer, &NSCLASS ack_tbl_timeout, 0);
+
+	return 0;
+}
+
+void NSCLASS ack_tbl_cleanup(void)
+{
+	tw_timer_del_sync(&ack_tbl_timer);
+
+	tbl_flush(&ack_tbl, NULL);
+
+#ifdef __KERNEL__
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
+	proc_net_remove(ACK_TBL_PROC_NAME);
+#else
+	proc_net_remove(&init_net, ACK_TBL_PROC_NAME);
+#endif
+#endif
+}
@@ -30,6 +30,19 @@ struct dsr_ack_opt {
 #define DSR_ACK_HDR_LEN sizeof(struct dsr_ack_opt)
 #define DSR_ACK_OPT_LEN (DSR_ACK_HDR_LEN - 2)
 
+struct ack_tbl_stats {
+	unsigned long sent;		/* ACKs sent in their own packet */
+	unsigned long piggybacked;	/* ACKs added to outgoing packets */
+	unsigned long coalesced;	/* ACKs covered by a pending ACK */
+};
+
+/* ACK IDs wrap around, so they are compared as serial numbers. Returns
+ * nonzero if id a is newer than id b. */
+static inline int dsr_ack_id_after(unsigned short a, unsigned short b)
+{
+	return (short)(a - b) > 0;
+}
+
 int dsr_ack_add_ack_req(struct in_addr neigh);
 #endif				/* NO_GLOBALS */
 
@@ -41,6 +54,14 @@ int dsr_ack_req_opt_recv(struct dsr_pkt *dp, struct dsr_ack_req_opt *areq);
 int dsr_ack_opt_recv(struct dsr_ack_opt *ack);
 int dsr_ack_req_send(struct in_addr neigh_addr, unsigned short id);
 int dsr_ack_send(struct in_addr dst, unsigned short id);
+char *dsr_ack_opt_space(struct dsr_pkt *dp, int len);
+void dsr_ack_piggyback(struct dsr_pkt *dp);
+
+void _ack_tbl_set_timeout(void);
+void ack_tbl_timeout(unsigned long data);
+int ack_tbl_add(struct in_addr neigh, unsigned short id);
+int ack_tbl_init(void);
+void ack_tbl_cleanup(void);
 
 #endif				/* NO_DECLS */
 
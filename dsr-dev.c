@@ -17,9 +17,17 @@
 #include <linux/etherdevice.h>
 #include <linux/init.h>
 #include <linux/if_ether.h>
+#include <linux/if_arp.h>
+#include <linux/proc_fs.h>
 #include <net/ip.h>
+#include <net/icmp.h>
+#include <net/dst.h>
 #include <linux/random.h>
 #include <linux/wireless.h>
+#include <linux/percpu.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#include <linux/u64_stats_sync.h>
+#endif
 
 #include "debug.h"
 #include "dsr.h"
@@ -33,8 +41,10 @@
 #include "send-buf.h"
 #include "maint-buf.h"
 #include "dsr-io.h"
+#include "timer-wheel.h"
 
 /* Our dsr device */
+#define DSR_DEV_MAX_QUEUES 16
 static struct net_device *dsr_dev;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,5,0)
 /* dsr_node must be static on some older kernels, otherwise it segfaults on
@@ -46,6 +56,30 @@ struct dsr_node *dsr_node;
 static int rp_filter = 0;
 static int forwarding = 0;
 
+/* Packets flagged with PKT_XMIT_JITTER (e.g., broadcast RREQs) are held back
+ * for a random time of up to BroadCastJitter, so that neighbors forwarding
+ * the same broadcast do not collide. */
+#define JITTER_Q_MAX_LEN 64
+
+struct jitter_entry {
+	list_t l;
+	struct sk_buff *skb;
+	struct timeval tx_time;
+};
+
+static TBL(jitter_q, JITTER_Q_MAX_LEN);
+static struct tw_timer jitter_timer;
+
+/* Per CPU transmit batch, see dsr_dev_queue_xmit() */
+#define DSR_TX_BATCH_MAX 128
+
+struct dsr_tx_batch {
+	struct sk_buff_head q;
+	int active;
+};
+
+static DEFINE_PER_CPU(struct dsr_tx_batch, dsr_tx_batch);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 #define DSRUU_IN_DEV_SET_RPFILTER(in_dev, val) (in_dev->cnf.rp_filter = val)
 #define DSRUU_IN_DEV_SET_FORWARD(in_dev, val) (in_dev->cnf.forwarding = val)
@@ -54,6 +88,46 @@ static int forwarding = 0;
 #define DSRUU_IN_DEV_SET_FORWARD(in_dev, val) (ipv4_devconf_set(in_dev, NET_IPV4_CONF_FORWARDING, val))
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
+#define skb_cow_head(skb, headroom) skb_cow(skb, headroom)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,31)
+#define skb_dst(skb) ((skb)->dst)
+#endif
+
+/* The DSR device advertises the MTU of the slave less the smallest DSR
+ * header, which is that of a route to a neighbor. Longer source routes
+ * leave less room, so the path MTU of each destination follows the length
+ * of its route. A packet that does not fit is refused and its route learns
+ * the smaller MTU. If the packet is DF, its sender gets an ICMP
+ * fragmentation needed. */
+#define PMTU_TBL_MAX_LEN 64
+#define PMTU_TBL_HASH_SIZE 32	/* Must be a power of two */
+#define PMTU_TBL_PROC_NAME "dsr_pmtu"
+
+/* Room for the ACK REQ and piggybacked ACK options that are added when
+ * the packet is transmitted */
+#define DSR_PMTU_ACK_RESERVE (DSR_ACK_REQ_HDR_LEN + DSR_ACK_HDR_LEN)
+#define DSR_HDR_MIN_LEN (DSR_OPT_HDR_LEN + DSR_SRT_HDR_LEN + \
+			 DSR_PMTU_ACK_RESERVE)
+
+struct pmtu_entry {
+	list_t l;
+	list_t hl;		/* Hash chain */
+	struct in_addr dst;
+	unsigned int hops;
+	unsigned int hdr_len;	/* DSR header of the current route */
+	unsigned int pmtu;
+	unsigned long pkts;
+	unsigned long too_big;	/* Packets refused */
+	unsigned long bytes;	/* IP packets as handed to the device */
+	unsigned long hdr_bytes;	/* DSR headers added to them */
+};
+
+static TBL(pmtu_tbl, PMTU_TBL_MAX_LEN);
+static list_t pmtu_hash[PMTU_TBL_HASH_SIZE];
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,14)
 static int dsr_dev_llrecv(struct sk_buff *skb, struct net_device *indev,
 			  struct packet_type *pt);
@@ -68,6 +142,27 @@ static struct packet_type dsr_packet_type = {
 	.func = dsr_dev_llrecv,
 };
 
+/* The IP header checksum is kept up to date as the header is modified, see
+ * dsr_build_ip(). Building with DSR_CSUM_DEBUG checks it once more against
+ * a full sum before the packet leaves. A bad checksum is reported and
+ * counted, but left as it is. */
+#ifdef DSR_CSUM_DEBUG
+static atomic_t csum_errors = ATOMIC_INIT(0);
+#endif
+
+static inline void dsr_ip_csum_verify(struct iphdr *iph)
+{
+#ifdef DSR_CSUM_DEBUG
+	if (WARN_ON_ONCE(ip_fast_csum((unsigned char *)iph, iph->ihl) != 0)) {
+		atomic_inc(&csum_errors);
+		LOG_DBG("Bad IP header checksum %s -> %s (%d so far)\n",
+			print_ip(*(struct in_addr *)&iph->saddr),
+			print_ip(*(struct in_addr *)&iph->daddr),
+			atomic_read(&csum_errors));
+	}
+#endif
+}
+
 struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 {
 	struct sk_buff *skb;
@@ -111,9 +206,7 @@ struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 
 	memcpy(buf, dp->nh.raw, ip_len);
 
-	/* For some reason the checksum has to be recalculated here, at least
-	 * when there is a record route IP option */
-	ip_send_check((struct iphdr *)buf);
+	dsr_ip_csum_verify((struct iphdr *)buf);
 
 	buf += ip_len;
 
@@ -130,39 +223,212 @@ struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 	return skb;
 }
 
-int dsr_hw_header_create(struct dsr_pkt *dp, struct sk_buff *skb)
+/* Reuse the skb that a packet arrived in, by writing its IP header and DSR
+ * options in front of the payload, instead of copying the whole packet into
+ * a new skb. The headroom is only reallocated if the options grew past it
+ * or the header is shared with a clone. Returns NULL if the skb cannot be
+ * reused, in which case it is left for dsr_skb_create(). */
+static struct sk_buff *dsr_skb_reuse(struct dsr_pkt *dp,
+				     struct net_device *dev)
+{
+	struct sk_buff *skb = dp->skb;
+	char ip_hdr[60];
+	unsigned char *buf;
+	int ip_len, dsr_opts_len, hdr_len;
+
+	if (!skb || skb_shared(skb) || skb_is_nonlinear(skb) ||
+	    skb->ip_summed == CHECKSUM_PARTIAL)
+		return NULL;
+
+	if ((unsigned char *)dp->payload < skb->data ||
+	    (unsigned char *)dp->payload + dp->payload_len > SKB_TAIL(skb))
+		return NULL;
+
+	ip_len = dp->nh.iph->ihl << 2;
+	dsr_opts_len = dsr_pkt_opts_len(dp);
+	hdr_len = ip_len + dsr_opts_len;
+
+	/* The new headers may overwrite the old IP header */
+	memcpy(ip_hdr, dp->nh.raw, ip_len);
+
+	/* Keep only the payload */
+	skb_pull(skb, (unsigned char *)dp->payload - skb->data);
+	skb_trim(skb, dp->payload_len);
+
+	if (skb_cow_head(skb, hdr_len + LL_RESERVED_SPACE(dev))) {
+		LOG_DBG("Could not expand headroom\n");
+		return NULL;
+	}
+
+	buf = skb_push(skb, hdr_len);
+
+	SKB_SET_NETWORK_HDR(skb, 0);
+	SKB_SET_MAC_HDR(skb, -(int)dev->hard_header_len);
+
+	memcpy(buf, ip_hdr, ip_len);
+	dsr_ip_csum_verify((struct iphdr *)buf);
+
+	/* Options that were never rewritten are still in the skb, right
+	 * where they go */
+	if (dsr_opts_len && !(dp->flags & PKT_OPTS_IN_SKB))
+		memcpy(buf + ip_len, dp->dh.raw, dsr_opts_len);
+
+	skb->dev = dev;
+	skb->protocol = htons(ETH_P_IP);
+	skb->ip_summed = CHECKSUM_NONE;
+
+	/* The skb now belongs to the caller */
+	dp->skb = NULL;
+	dp->payload = NULL;
+	dp->nh.raw = NULL;
+
+	return skb;
+}
+
+int dsr_hw_header_create(struct dsr_pkt *dp, struct sk_buff *skb,
+			 struct neighbor *neigh)
 {
 
 	struct sockaddr broadcast =
 	    { AF_UNSPEC, {0xff, 0xff, 0xff, 0xff, 0xff, 0xff} };
-	struct neighbor_info neigh_info;
+	struct sockaddr *hw_addr;
 
 	if (dp->dst.s_addr == DSR_BROADCAST)
-		memcpy(neigh_info.hw_addr.sa_data, broadcast.sa_data, ETH_ALEN);
+		hw_addr = &broadcast;
+	else if (neigh)
+		hw_addr = &neigh->hw_addr;
 	else {
-		/* Get hardware destination address */
-		if (neigh_tbl_query(dp->nxt_hop, &neigh_info) < 0) {
-			LOG_DBG("Could not get hardware address for next hop %s\n",
-			     print_ip(dp->nxt_hop));
+		LOG_DBG("Could not get hardware address for next hop %s\n",
+			print_ip(dp->nxt_hop));
+		return -1;
+	}
+
+	/* On Ethernet slaves, the unicast header of a neighbor is built once
+	 * and then copied. It is rebuilt if the slave, or its address,
+	 * changes. */
+	if (hw_addr != &broadcast && skb->dev->type == ARPHRD_ETHER) {
+		struct net_device *dev = skb->dev;
+
+		if (skb_headroom(skb) < ETH_HLEN)
 			return -1;
+
+		spin_lock_bh(&neigh->lock);
+
+		if (neigh->hh_ifindex != dev->ifindex ||
+		    memcmp(neigh->hh.h_source, dev->dev_addr, ETH_ALEN)) {
+			memcpy(neigh->hh.h_dest, hw_addr->sa_data, ETH_ALEN);
+			memcpy(neigh->hh.h_source, dev->dev_addr, ETH_ALEN);
+			neigh->hh.h_proto = htons(ETH_P_IP);
+			neigh->hh_ifindex = dev->ifindex;
 		}
+		memcpy(skb_push(skb, ETH_HLEN), &neigh->hh, ETH_HLEN);
+
+		spin_unlock_bh(&neigh->lock);
+
+		return 0;
 	}
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
 	if (skb->dev->hard_header) {
 		skb->dev->hard_header(skb, skb->dev, ETH_P_IP,
-				      neigh_info.hw_addr.sa_data, 0, skb->len);
+				      hw_addr->sa_data, 0, skb->len);
 	} else {
 		LOG_DBG("Missing hard_header\n");
 		return -1;
 	}
 #else
 	dev_hard_header(skb, skb->dev, ETH_P_IP,
-			neigh_info.hw_addr.sa_data, 0, skb->len);	
+			hw_addr->sa_data, 0, skb->len);	
 #endif
 	return 0;
 }
 
+static void dsr_conf_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct dsr_conf, rcu));
+}
+
+/* Copy the current snapshot for modification. The node must be locked. */
+static struct dsr_conf *dsr_conf_copy(struct dsr_node *dn)
+{
+	struct dsr_conf *conf;
+
+	conf = kmalloc(sizeof(struct dsr_conf), GFP_ATOMIC);
+
+	if (conf)
+		memcpy(conf, dn->conf, sizeof(struct dsr_conf));
+
+	return conf;
+}
+
+/* Swap in a new snapshot, freeing the old one once no reader can see it.
+ * The node must be locked. */
+static void dsr_conf_publish(struct dsr_node *dn, struct dsr_conf *conf)
+{
+	struct dsr_conf *old = dn->conf;
+
+	rcu_assign_pointer(dn->conf, conf);
+
+	if (old)
+		call_rcu(&old->rcu, dsr_conf_free);
+}
+
+int set_confval(enum confval cv, unsigned int val)
+{
+	struct dsr_conf *conf;
+
+	if (!dsr_node)
+		return -1;
+
+	dsr_node_lock(dsr_node);
+
+	conf = dsr_conf_copy(dsr_node);
+
+	if (!conf) {
+		dsr_node_unlock(dsr_node);
+		return -1;
+	}
+	conf->confvals[cv] = val;
+	dsr_conf_publish(dsr_node, conf);
+
+	dsr_node_unlock(dsr_node);
+
+	return val;
+}
+
+int dsr_node_set_addrs(struct dsr_node *dn, struct in_addr ifaddr,
+		       struct in_addr bcaddr)
+{
+	struct dsr_conf *conf;
+
+	dsr_node_lock(dn);
+
+	conf = dsr_conf_copy(dn);
+
+	if (!conf) {
+		dsr_node_unlock(dn);
+		return -1;
+	}
+	conf->ifaddr = ifaddr;
+	conf->bcaddr = bcaddr;
+	dsr_conf_publish(dn, conf);
+
+	dsr_node_unlock(dn);
+
+	return 0;
+}
+
+/* Free the snapshot of a node that is going away, and any that are still
+ * waiting for readers */
+void dsr_node_release_conf(struct dsr_node *dn)
+{
+	dsr_node_lock(dn);
+	dsr_conf_publish(dn, NULL);
+	dsr_node_unlock(dn);
+
+	rcu_barrier();
+}
+
 static int dsr_dev_inetaddr_event(struct notifier_block *this,
 				  unsigned long event, void *ptr)
 {
@@ -187,10 +453,12 @@ static int dsr_dev_inetaddr_event(struct notifier_block *this,
 
 			dnode = netdev_priv(indev->dev);
 
-			dsr_node_lock(dnode);
-			dnode->ifaddr.s_addr = ifa->ifa_address;
-			dnode->bcaddr.s_addr = ifa->ifa_broadcast;
+			addr.s_addr = ifa->ifa_address;
+			bc.s_addr = ifa->ifa_broadcast;
+
+			dsr_node_set_addrs(dnode, addr, bc);
 
+			dsr_node_lock(dnode);
 			dnode->slave_indev = in_dev_get(dnode->slave_dev);
 
                         /* Disable rp_filter and enable forwarding */
@@ -203,9 +471,6 @@ static int dsr_dev_inetaddr_event(struct notifier_block *this,
                         }			
 			dsr_node_unlock(dnode);
 			
-			addr.s_addr = ifa->ifa_address;
-			bc.s_addr = ifa->ifa_broadcast;
-			
 			LOG_DBG("New ip=%s broadcast=%s\n",
 			      print_ip(addr), print_ip(bc));
 		}
@@ -239,13 +504,10 @@ static int dsr_dev_netdev_event(struct notifier_block *this,
 			dev_hold(dev);
 			dsr_node_unlock(dnode);
 
-			/* Reduce the MTU to allow DSR options of 100
-			 * bytes. If larger, drop or implement
-			 * fragmentation... ;-) Alternatively find a
-			 * way to dynamically reduce the data size of
-			 * packets depending on the size of the DSR
-			 * header. */
-			dsr_dev->mtu = dev->mtu - DSR_OPTS_MAX_SIZE;
+			/* Leave room for the smallest DSR header. Longer
+			 * routes are handled per destination, see
+			 * dsr_pmtu_check(). */
+			dsr_dev->mtu = dev->mtu - DSR_HDR_MIN_LEN;
 			
 			LOG_DBG("Registering packet type\n");
 			dsr_packet_type.func = dsr_dev_llrecv;
@@ -261,6 +523,12 @@ static int dsr_dev_netdev_event(struct notifier_block *this,
 	case NETDEV_CHANGE:
 		LOG_DBG("Netdev change\n");
 		break;
+	case NETDEV_CHANGEMTU:
+		if (dev == dnode->slave_dev) {
+			LOG_DBG("Slave MTU changed to %u\n", dev->mtu);
+			dsr_dev->mtu = dev->mtu - DSR_HDR_MIN_LEN;
+		}
+		break;
 	case NETDEV_UP:
 		LOG_DBG("Netdev up %s\n", dev->name);
 		if (ConfVal(PromiscOperation) &&
@@ -317,6 +585,62 @@ static int dsr_dev_netdev_event(struct notifier_block *this,
 static int dsr_dev_start_xmit(struct sk_buff *skb, struct net_device *dev);
 static struct net_device_stats *dsr_dev_get_stats(struct net_device *dev);
 
+/* The device counters are kept per CPU, so that packets on different CPUs
+ * neither take the node lock nor share cache lines to count. They are summed
+ * when read, in dsr_dev_get_stats(). */
+struct dsr_dev_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 tx_packets;
+	u64 tx_bytes;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	struct u64_stats_sync syncp;
+#endif
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#define dsr_stats_update_begin(s) u64_stats_update_begin(&(s)->syncp)
+#define dsr_stats_update_end(s) u64_stats_update_end(&(s)->syncp)
+#define dsr_stats_fetch_begin(s) u64_stats_fetch_begin(&(s)->syncp)
+#define dsr_stats_fetch_retry(s, start) u64_stats_fetch_retry(&(s)->syncp, start)
+#else
+/* Reads of the 64 bit counters may tear on 32 bit machines */
+#define dsr_stats_update_begin(s) do { } while (0)
+#define dsr_stats_update_end(s) do { } while (0)
+#define dsr_stats_fetch_begin(s) 0
+#define dsr_stats_fetch_retry(s, start) ((void)(start), 0)
+#endif
+
+#ifndef this_cpu_ptr
+#define this_cpu_ptr(ptr) per_cpu_ptr(ptr, smp_processor_id())
+#endif
+
+static inline void dsr_dev_stats_rx(struct dsr_node *dnode, unsigned int len)
+{
+	struct dsr_dev_stats *s;
+
+	local_bh_disable();
+	s = this_cpu_ptr(dnode->pcpu_stats);
+	dsr_stats_update_begin(s);
+	s->rx_packets++;
+	s->rx_bytes += len;
+	dsr_stats_update_end(s);
+	local_bh_enable();
+}
+
+static inline void dsr_dev_stats_tx(struct dsr_node *dnode, unsigned int len)
+{
+	struct dsr_dev_stats *s;
+
+	local_bh_disable();
+	s = this_cpu_ptr(dnode->pcpu_stats);
+	dsr_stats_update_begin(s);
+	s->tx_packets++;
+	s->tx_bytes += len;
+	dsr_stats_update_end(s);
+	local_bh_enable();
+}
+
 static int dsr_dev_set_address(struct net_device *dev, void *p)
 {
 	struct sockaddr *sa = p;
@@ -330,13 +654,21 @@ static int dsr_dev_set_address(struct net_device *dev, void *p)
 
 static int dsr_dev_open(struct net_device *dev)
 {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	netif_tx_start_all_queues(dev);
+#else
 	netif_start_queue(dev);
+#endif
 	return 0;
 }
 
 static int dsr_dev_stop(struct net_device *dev)
 {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	netif_tx_stop_all_queues(dev);
+#else
 	netif_stop_queue(dev);
+#endif
 	return 0;
 }
 
@@ -364,6 +696,17 @@ static void dsr_dev_uninit(struct net_device *dev)
 	dsr_node = NULL;
 }
 
+/* Stop taking packets from the slave. The device itself stays until
+ * dsr_dev_cleanup(). */
+void dsr_dev_rx_stop(void)
+{
+	if (dsr_packet_type.func) {
+		LOG_DBG("Removing pack\n");
+		dev_remove_pack(&dsr_packet_type);
+		dsr_packet_type.func = NULL;
+	}
+}
+
 /* fake multicast ability */
 /*
 static void dsr_dev_set_multicast_list(struct net_device *dev)
@@ -371,12 +714,29 @@ static void dsr_dev_set_multicast_list(struct net_device *dev)
 }
 */
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,28)
+/* Local flows are spread over the transmit queues by their flow hash, so
+ * that the packets of a flow stay in order */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+static u16 dsr_dev_select_queue(struct net_device *dev, struct sk_buff *skb)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+static u16 dsr_dev_select_queue(struct net_device *dev, struct sk_buff *skb,
+				void *accel_priv)
+#else
+static u16 dsr_dev_select_queue(struct net_device *dev, struct sk_buff *skb,
+				void *accel_priv,
+				select_queue_fallback_t fallback)
+#endif
+{
+	return skb_tx_hash(dev, skb);
+}
+
 static const struct net_device_ops dsr_netdev_ops = {
 	.ndo_get_stats = dsr_dev_get_stats,
 	.ndo_uninit = dsr_dev_uninit,
 	.ndo_open = dsr_dev_open,
 	.ndo_stop = dsr_dev_stop,
 	.ndo_start_xmit = dsr_dev_start_xmit,
+	.ndo_select_queue = dsr_dev_select_queue,
 	.ndo_set_mac_address = dsr_dev_set_address,
 	/* .ndo_set_multicast_list = dsr_dev_set_multicast_list, */
 };
@@ -410,6 +770,15 @@ static void dsr_dev_setup(struct net_device *dev)
 	//dev->destructor = dsr_dev_free;
 
 	dev->tx_queue_len = 0;
+
+	/* Transmission does its own locking, so senders on different CPUs
+	 * do not serialize on the queue lock */
+	dev->features |= NETIF_F_LLTX;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,31)
+	/* Keep the route, so that its path MTU can be updated */
+	dev->priv_flags &= ~IFF_XMIT_DST_RELEASE;
+#endif
+
 	dev->flags |= IFF_NOARP;
 	dev->flags &= ~IFF_MULTICAST;
 	get_random_bytes(dev->dev_addr, 6);
@@ -433,6 +802,47 @@ static char *pkt_type_str[] = {
 };
 #endif
 
+/* Overheard packets have not been through ip_rcv(), so the IP header is
+ * checked here. The skb is shared with the other packet handlers and is
+ * unshared before it is changed. Returns NULL if the packet was dropped. */
+static struct sk_buff *dsr_dev_promisc_check(struct sk_buff *skb)
+{
+	struct iphdr *iph;
+	unsigned int len;
+
+	skb = skb_share_check(skb, GFP_ATOMIC);
+
+	if (!skb)
+		return NULL;
+
+	if (!pskb_may_pull(skb, sizeof(struct iphdr)))
+		goto drop;
+
+	iph = (struct iphdr *)skb->data;
+
+	if (iph->ihl < 5 || iph->version != 4 ||
+	    iph->protocol != IPPROTO_DSR)
+		goto drop;
+
+	if (!pskb_may_pull(skb, iph->ihl << 2))
+		goto drop;
+
+	iph = (struct iphdr *)skb->data;
+	len = ntohs(iph->tot_len);
+
+	if (skb->len < len || len < (iph->ihl << 2))
+		goto drop;
+
+	/* Remove link layer padding */
+	if (pskb_trim_rcsum(skb, len))
+		goto drop;
+
+	return skb;
+      drop:
+	dev_kfree_skb_any(skb);
+	return NULL;
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,14)
 static int dsr_dev_llrecv(struct sk_buff *skb,
 			  struct net_device *indev, 
@@ -460,6 +870,17 @@ static int dsr_dev_llrecv(struct sk_buff *skb,
 		dsr_ip_recv(skb);
 		break;
 	case PACKET_OTHERHOST:
+		/* Overheard DSR packets feed the route cache and passive
+		 * ACKs */
+		if (ConfVal(PromiscOperation)) {
+			skb = dsr_dev_promisc_check(skb);
+
+			if (skb)
+				dsr_ip_recv(skb);
+			break;
+		}
+		dev_kfree_skb_any(skb);
+		break;
 	case PACKET_OUTGOING:
 	case PACKET_LOOPBACK:
 	case PACKET_FASTROUTE:
@@ -499,8 +920,9 @@ int dsr_dev_deliver(struct dsr_pkt *dp)
 				rr->off -= 4;
 				rr->len -= 4;
 				opt->optlen -= 4;
+
+				ip_send_check(SKB_NETWORK_HDR_IPH(dp->skb));
 			}
-			/* ip_send_check(dp->skb->nh.iph); */
 		}
 	}
 
@@ -528,10 +950,7 @@ int dsr_dev_deliver(struct dsr_pkt *dp)
 	memset(ethh->h_source, 0, ETH_ALEN);
 	ethh->h_proto = htons(ETH_P_IP);
 
-	dsr_node_lock(dsr_node);
-	dsr_node->stats.rx_packets++;
-	dsr_node->stats.rx_bytes += skb->len;
-	dsr_node_unlock(dsr_node);
+	dsr_dev_stats_rx(dsr_node, skb->len);
 
 	netif_rx(skb);
 
@@ -540,10 +959,347 @@ int dsr_dev_deliver(struct dsr_pkt *dp)
 	return 0;
 }
 
+static int __dsr_dev_queue_xmit(struct sk_buff *skb)
+{
+	int len = skb->len;
+	int res;
+
+	/* TODO: Should consider using ip_finish_output instead */
+	res = dev_queue_xmit(skb);
+
+	if (res < 0)
+		return res;
+
+	dsr_dev_stats_tx(dsr_node, len);
+
+	return res;
+}
+
+/* Packets sent while a batch is open on a CPU are held until the batch is
+ * flushed, and then handed to the slave grouped by next hop, so that the
+ * frames for one neighbor go out back to back. */
+static int dsr_dev_queue_xmit(struct sk_buff *skb)
+{
+	struct dsr_tx_batch *b;
+
+	local_bh_disable();
+
+	b = &per_cpu(dsr_tx_batch, smp_processor_id());
+
+	if (b->active && skb_queue_len(&b->q) < DSR_TX_BATCH_MAX) {
+		__skb_queue_tail(&b->q, skb);
+		local_bh_enable();
+		return 0;
+	}
+	local_bh_enable();
+
+	return __dsr_dev_queue_xmit(skb);
+}
+
+/* Open a transmit batch on this CPU. Must be called with bottom halves
+ * disabled, and followed by dsr_dev_tx_batch_flush() on the same CPU. */
+void dsr_dev_tx_batch_begin(void)
+{
+	per_cpu(dsr_tx_batch, smp_processor_id()).active = 1;
+}
+
+void dsr_dev_tx_batch_flush(void)
+{
+	struct dsr_tx_batch *b = &per_cpu(dsr_tx_batch, smp_processor_id());
+	struct sk_buff_head hop;
+	struct sk_buff *first;
+
+	b->active = 0;
+
+	__skb_queue_head_init(&hop);
+
+	while ((first = __skb_dequeue(&b->q))) {
+		struct sk_buff *skb, *tmp;
+
+		__skb_queue_tail(&hop, first);
+
+		/* The destination address leads the hardware header */
+		skb_queue_walk_safe(&b->q, skb, tmp) {
+			if (skb->dev == first->dev &&
+			    memcmp(skb->data, first->data,
+				   skb->dev->addr_len) == 0) {
+				__skb_unlink(skb, &b->q);
+				__skb_queue_tail(&hop, skb);
+			}
+		}
+		while ((skb = __skb_dequeue(&hop)))
+			__dsr_dev_queue_xmit(skb);
+	}
+}
+
+static inline int crit_tx_time(void *pos, void *data)
+{
+	struct jitter_entry *e = (struct jitter_entry *)pos;
+	struct jitter_entry *n = (struct jitter_entry *)data;
+
+	if (timeval_diff(&e->tx_time, &n->tx_time) > 0)
+		return 1;
+	return 0;
+}
+
+static void dsr_dev_jitter_timeout(unsigned long data)
+{
+	struct timeval now;
+	list_t expired, *pos, *tmp;
+
+	INIT_LIST_HEAD(&expired);
+
+	gettime(&now);
+
+	write_lock_bh(&jitter_q.lock);
+
+	while (!TBL_EMPTY(&jitter_q)) {
+		struct jitter_entry *e =
+		    (struct jitter_entry *)TBL_FIRST(&jitter_q);
+
+		if (timeval_diff(&e->tx_time, &now) > 0) {
+			tw_timer_set(&jitter_timer, &e->tx_time);
+			break;
+		}
+		__tbl_detach(&jitter_q, &e->l);
+		list_add_tail(&e->l, &expired);
+	}
+
+	write_unlock_bh(&jitter_q.lock);
+
+	dsr_dev_tx_batch_begin();
+
+	list_for_each_safe(pos, tmp, &expired) {
+		struct jitter_entry *e = (struct jitter_entry *)pos;
+
+		list_del(&e->l);
+		dsr_dev_queue_xmit(e->skb);
+		kfree(e);
+	}
+	dsr_dev_tx_batch_flush();
+}
+
+/* Queue a packet for transmission after a random jitter. If the queue is
+ * full, the packet is sent right away. */
+static int dsr_dev_jitter_xmit(struct sk_buff *skb)
+{
+	struct jitter_entry *e;
+	usecs_t jitter = ConfValToUsecs(BroadCastJitter);
+
+	if (jitter == 0)
+		return dsr_dev_queue_xmit(skb);
+
+	e = (struct jitter_entry *)kmalloc(sizeof(struct jitter_entry),
+					   GFP_ATOMIC);
+
+	if (!e)
+		return dsr_dev_queue_xmit(skb);
+
+	e->skb = skb;
+	gettime(&e->tx_time);
+	timeval_add_usecs(&e->tx_time, net_random() % jitter);
+
+	write_lock_bh(&jitter_q.lock);
+
+	if (__tbl_add(&jitter_q, &e->l, crit_tx_time) < 0) {
+		write_unlock_bh(&jitter_q.lock);
+		kfree(e);
+		return dsr_dev_queue_xmit(skb);
+	}
+
+	if (TBL_FIRST(&jitter_q) == &e->l)
+		tw_timer_set(&jitter_timer, &e->tx_time);
+
+	write_unlock_bh(&jitter_q.lock);
+
+	return 0;
+}
+
+static inline unsigned int pmtu_hash_idx(struct in_addr addr)
+{
+	return ntohl(addr.s_addr) & (PMTU_TBL_HASH_SIZE - 1);
+}
+
+static struct pmtu_entry *__pmtu_tbl_find(struct in_addr dst)
+{
+	list_t *pos;
+
+	list_for_each(pos, &pmtu_hash[pmtu_hash_idx(dst)]) {
+		struct pmtu_entry *e = list_entry(pos, struct pmtu_entry, hl);
+
+		if (e->dst.s_addr == dst.s_addr)
+			return e;
+	}
+	return NULL;
+}
+
+/* Look up the entry of a destination, or add one in place of the least
+ * recently used. The table must be write locked. */
+static struct pmtu_entry *__pmtu_tbl_get(struct in_addr dst)
+{
+	struct pmtu_entry *e = __pmtu_tbl_find(dst);
+
+	if (e) {
+		list_move_tail(&e->l, &pmtu_tbl.head);
+		return e;
+	}
+
+	if (TBL_FULL(&pmtu_tbl)) {
+		e = (struct pmtu_entry *)TBL_FIRST(&pmtu_tbl);
+		__tbl_detach(&pmtu_tbl, &e->l);
+		list_del(&e->hl);
+	} else {
+		e = (struct pmtu_entry *)kmalloc(sizeof(struct pmtu_entry),
+						 GFP_ATOMIC);
+		if (!e)
+			return NULL;
+	}
+	memset(e, 0, sizeof(struct pmtu_entry));
+	e->dst = dst;
+
+	__tbl_add_tail(&pmtu_tbl, &e->l);
+	list_add(&e->hl, &pmtu_hash[pmtu_hash_idx(dst)]);
+
+	return e;
+}
+
+/* Lower the MTU of the route of a packet that is too big for its source
+ * route, and tell the sender if the packet may not be fragmented */
+static void dsr_pmtu_report(struct sk_buff *skb, unsigned int mtu)
+{
+	struct dst_entry *dst = skb_dst(skb);
+
+	if (mtu < 68)
+		return;
+
+	if (dst && dst->ops->update_pmtu)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+		dst->ops->update_pmtu(dst, mtu);
+#else
+		dst->ops->update_pmtu(dst, NULL, skb, mtu);
+#endif
+
+	if (SKB_NETWORK_HDR_IPH(skb)->frag_off & htons(IP_DF))
+		icmp_send(skb, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED, htonl(mtu));
+}
+
+/* Called before a source route with a DSR header of hdr_len bytes is added
+ * to an originated packet. Returns -1 if the packet will not fit the slave
+ * device, in which case it must be dropped. */
+int dsr_pmtu_check(struct dsr_pkt *dp, int hdr_len)
+{
+	struct pmtu_entry *e;
+	unsigned int mtu = 0, len;
+	int res = 0;
+
+	if (!dp->skb || !dp->nh.iph || !dp->srt)
+		return 0;
+
+	dsr_node_lock(dsr_node);
+	if (dsr_node->slave_dev)
+		mtu = dsr_node->slave_dev->mtu;
+	dsr_node_unlock(dsr_node);
+
+	if (mtu <= hdr_len + DSR_PMTU_ACK_RESERVE)
+		return 0;
+
+	mtu -= hdr_len + DSR_PMTU_ACK_RESERVE;
+	len = ntohs(dp->nh.iph->tot_len);
+
+	/* Nothing larger than the slave MTU is sent. Packets that are not
+	 * DF are dropped too, but the smaller route MTU makes the IP layer
+	 * fragment those that follow. */
+	if (len > mtu)
+		res = -1;
+
+	write_lock_bh(&pmtu_tbl.lock);
+
+	e = __pmtu_tbl_get(dp->dst);
+
+	if (e) {
+		e->hops = dp->srt->laddrs / sizeof(struct in_addr) + 1;
+		e->hdr_len = hdr_len;
+		e->pmtu = mtu;
+
+		if (res < 0)
+			e->too_big++;
+		else {
+			e->pkts++;
+			e->bytes += len;
+			e->hdr_bytes += hdr_len;
+		}
+	}
+	write_unlock_bh(&pmtu_tbl.lock);
+
+	if (res < 0) {
+		LOG_DBG("%d bytes to %s exceed the path MTU %u\n",
+			len, print_ip(dp->dst), mtu);
+		dsr_pmtu_report(dp->skb, mtu);
+	}
+	return res;
+}
+
+static int pmtu_tbl_print(struct tbl *t, char *buf)
+{
+	list_t *pos;
+	int len = 0;
+
+	read_lock_bh(&t->lock);
+
+	len += sprintf(buf, "# %-15s %-4s %-4s %-5s %-8s %-7s %-10s %s\n",
+		       "Destination", "Hops", "Hdr", "PMTU", "Pkts", "TooBig",
+		       "Bytes", "Goodput(%)");
+
+	list_for_each(pos, &t->head) {
+		struct pmtu_entry *e = (struct pmtu_entry *)pos;
+		unsigned long wire = e->bytes + e->hdr_bytes;
+		int n;
+
+		/* The share of the transmitted bytes that is not DSR
+		 * header */
+		n = snprintf(buf + len, PAGE_SIZE - len,
+			     "  %-15s %-4u %-4u %-5u %-8lu %-7lu %-10lu %lu\n",
+			     print_ip(e->dst), e->hops, e->hdr_len, e->pmtu,
+			     e->pkts, e->too_big, e->bytes,
+			     wire ? e->bytes / (wire / 100 ? wire / 100 : 1)
+			     : 0);
+
+		/* The proc buffer is one page, rows that do not fit are
+		 * left out */
+		if (len + n >= PAGE_SIZE)
+			break;
+
+		len += n;
+	}
+
+	read_unlock_bh(&t->lock);
+
+	return len;
+}
+
+static int
+pmtu_tbl_proc_info(char *buffer, char **start, off_t offset, int length,
+		   int *eof, void *data)
+{
+	int len;
+
+	len = pmtu_tbl_print(&pmtu_tbl, buffer);
+
+	*start = buffer + offset;
+	len -= offset;
+	if (len > length)
+		len = length;
+	else if (len < 0)
+		len = 0;
+	return len;
+}
+
 int dsr_dev_xmit(struct dsr_pkt *dp)
 {
 	struct sk_buff *skb;
 	struct net_device *slave_dev;
+	struct maint_entry *m = NULL;
+	struct neighbor *neigh = NULL;
 	struct in_addr dst;
 	int res = -1;
 	int len = 0;	
@@ -551,8 +1307,26 @@ int dsr_dev_xmit(struct dsr_pkt *dp)
 	if (!dp)
 		return -1;
 
+	/* The next hop is looked up once, for both the ACK REQ and the
+	 * hardware header */
+	if (dp->dst.s_addr != DSR_BROADCAST) {
+		neigh = neigh_tbl_lookup(dp->nxt_hop);
+
+		/* The neighbor has expired, so the link has no hardware
+		 * address. It is removed, so that the next packets look for
+		 * another route. */
+		if (!neigh)
+			lc_link_del(my_addr(), dp->nxt_hop);
+	}
+
+	/* ACKs deferred by the receive batch may go along */
+	if (neigh)
+		dsr_rx_batch_ack_flush();
+
+	dsr_ack_piggyback(dp);
+
 	if (dp->flags & PKT_REQUEST_ACK)
-		maint_buf_add(dp);
+		m = maint_buf_entry_create(dp, neigh);
 
 	dsr_node_lock(dsr_node);
 
@@ -564,15 +1338,27 @@ int dsr_dev_xmit(struct dsr_pkt *dp)
 	}
 	dsr_node_unlock(dsr_node);
 
-	skb = dsr_skb_create(dp, slave_dev);
+	/* Forwarded and originated packets are sent in the skb that they
+	 * arrived in when possible, otherwise the packet is rebuilt */
+	skb = dsr_skb_reuse(dp, slave_dev);
+
+	if (!skb)
+		skb = dsr_skb_create(dp, slave_dev);
 
 	if (!skb) {
 		LOG_DBG("Could not create skb!\n");
 		goto out_err;
 	}
 
+	/* Keep a reference to the built packet for retransmission and
+	 * salvaging. The clone shares the data with the transmitted skb. */
+	if (m) {
+		maint_buf_add(m, skb_clone(skb, GFP_ATOMIC));
+		m = NULL;
+	}
+
 	/* Create hardware header */
-	if (dsr_hw_header_create(dp, skb) < 0) {
+	if (dsr_hw_header_create(dp, skb, neigh) < 0) {
 		LOG_DBG("Could not create hardware header\n");
 		dev_kfree_skb_any(skb);
 		goto out_err;
@@ -585,19 +1371,19 @@ int dsr_dev_xmit(struct dsr_pkt *dp)
 	      len, skb->data_len,
 	      print_eth(SKB_MAC_HDR_RAW(skb)),
 	      print_ip(dst));
-		
-	/* TODO: Should consider using ip_finish_output instead */
-	res = dev_queue_xmit(skb);
 
-	if (res < 0)
-		goto out_err;
-
-	dsr_node_lock(dsr_node);
-	dsr_node->stats.tx_packets++;
-	dsr_node->stats.tx_bytes += len;
-	dsr_node_unlock(dsr_node);
+	if (dp->flags & PKT_XMIT_JITTER)
+		res = dsr_dev_jitter_xmit(skb);
+	else
+		res = dsr_dev_queue_xmit(skb);
 
 out_err:
+	if (m)
+		maint_buf_add(m, NULL);
+
+	if (neigh)
+		neigh_put(neigh);
+
 	dsr_pkt_free(dp);
 
 	return res;
@@ -646,6 +1432,33 @@ static int dsr_dev_start_xmit(struct sk_buff *skb, struct net_device *dev)
 static struct net_device_stats *dsr_dev_get_stats(struct net_device *dev)
 {
 	struct dsr_node *dnode = netdev_priv(dev);
+	u64 rx_packets = 0, rx_bytes = 0, tx_packets = 0, tx_bytes = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct dsr_dev_stats *s = per_cpu_ptr(dnode->pcpu_stats, cpu);
+		u64 rxp, rxb, txp, txb;
+		unsigned int start;
+
+		do {
+			start = dsr_stats_fetch_begin(s);
+			rxp = s->rx_packets;
+			rxb = s->rx_bytes;
+			txp = s->tx_packets;
+			txb = s->tx_bytes;
+		} while (dsr_stats_fetch_retry(s, start));
+
+		rx_packets += rxp;
+		rx_bytes += rxb;
+		tx_packets += txp;
+		tx_bytes += txb;
+	}
+
+	dnode->stats.rx_packets = rx_packets;
+	dnode->stats.rx_bytes = rx_bytes;
+	dnode->stats.tx_packets = tx_packets;
+	dnode->stats.tx_bytes = tx_bytes;
+
 	return &dnode->stats;
 }
 
@@ -661,7 +1474,7 @@ static struct notifier_block inetaddr_notifier = {
 
 int dsr_dev_init(char *ifname)
 {
-	int res = 0;
+	int res = 0, i;
 	struct dsr_node *dnode;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,5,0)
@@ -673,15 +1486,55 @@ int dsr_dev_init(char *ifname)
 	dsr_dev->init = dsr_dev_setup;
 
 	dev_alloc_name(dsr_dev, "dsr%d");
-#else
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
 	dsr_dev = alloc_netdev(sizeof(struct dsr_node), "dsr%d", dsr_dev_setup);
 
+	if (!dsr_dev)
+		return -ENOMEM;
+#else
+	/* One transmit queue per CPU, up to a limit */
+	dsr_dev = alloc_netdev_mq(sizeof(struct dsr_node), "dsr%d",
+				  dsr_dev_setup,
+				  min_t(unsigned int, num_possible_cpus(),
+					DSR_DEV_MAX_QUEUES));
+
 	if (!dsr_dev)
 		return -ENOMEM;
 #endif
 	dnode = dsr_node = netdev_priv(dsr_dev);
 
-	dsr_node_init(dnode, ifname);
+	dnode->pcpu_stats = alloc_percpu(struct dsr_dev_stats);
+
+	if (!dnode->pcpu_stats) {
+		res = -ENOMEM;
+		goto cleanup_netdev;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+	{
+		int cpu;
+
+		for_each_possible_cpu(cpu)
+			u64_stats_init(&per_cpu_ptr(dnode->pcpu_stats,
+						    cpu)->syncp);
+	}
+#endif
+	res = dsr_node_init(dnode, ifname);
+
+	if (res < 0)
+		goto cleanup_netdev;
+
+	tw_timer_init(&jitter_timer, dsr_dev_jitter_timeout, 0);
+
+	{
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct dsr_tx_batch *b = &per_cpu(dsr_tx_batch, cpu);
+
+			skb_queue_head_init(&b->q);
+			b->active = 0;
+		}
+	}
 
 	if (!ifname) {
 		struct net_device *dev;
@@ -713,13 +1566,25 @@ int dsr_dev_init(char *ifname)
 	}
 dev_found:
 	LOG_DBG("Slave device is %s\n", dnode->slave_ifname);	
-		
+
+	for (i = 0; i < PMTU_TBL_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&pmtu_hash[i]);
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
+#define proc_net init_net.proc_net
+#endif
+	if (!create_proc_read_entry(PMTU_TBL_PROC_NAME, 0, proc_net,
+				    pmtu_tbl_proc_info, NULL)) {
+		res = -1;
+		goto cleanup_netdev;
+	}
+
 	res = register_netdev(dsr_dev);
 
 	dsr_packet_type.func = NULL;
 
 	if (res < 0)
-		goto cleanup_netdev;
+		goto cleanup_proc;
 
 	res = register_netdevice_notifier(&netdev_notifier);
 
@@ -739,7 +1604,15 @@ dev_found:
 	unregister_netdevice_notifier(&netdev_notifier);
  cleanup_netdev_register:
 	unregister_netdev(dsr_dev);
+ cleanup_proc:
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
+	proc_net_remove(PMTU_TBL_PROC_NAME);
+#else
+	proc_net_remove(&init_net, PMTU_TBL_PROC_NAME);
+#endif
  cleanup_netdev:
+	kfree(dnode->conf);
+	free_percpu(dnode->pcpu_stats);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,5,0)
 	free_netdev(dsr_dev);
 #else
@@ -748,12 +1621,30 @@ dev_found:
 	return res;
 }
 
-void __exit dsr_dev_cleanup(void)
+void dsr_dev_cleanup(void)
 {
+	struct jitter_entry *e;
+
+	tw_timer_del_sync(&jitter_timer);
+
+	while ((e = (struct jitter_entry *)tbl_detach_first(&jitter_q))) {
+		dev_kfree_skb_any(e->skb);
+		kfree(e);
+	}
 
 	unregister_netdevice_notifier(&netdev_notifier);
 	unregister_inetaddr_notifier(&inetaddr_notifier);
 	unregister_netdev(dsr_dev);
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
+	proc_net_remove(PMTU_TBL_PROC_NAME);
+#else
+	proc_net_remove(&init_net, PMTU_TBL_PROC_NAME);
+#endif
+	tbl_flush(&pmtu_tbl, NULL);
+
+	dsr_node_release_conf(netdev_priv(dsr_dev));
+	free_percpu(((struct dsr_node *)netdev_priv(dsr_dev))->pcpu_stats);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,5,0)
 	free_netdev(dsr_dev);
 #else
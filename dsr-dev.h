@@ -18,8 +18,11 @@
 
 int dsr_dev_xmit(struct dsr_pkt *dp);
 int dsr_dev_deliver(struct dsr_pkt *dp);
+void dsr_dev_tx_batch_begin(void);
+void dsr_dev_tx_batch_flush(void);
+void dsr_dev_rx_stop(void);
 
 int __init dsr_dev_init(char *ifname);
-void __exit dsr_dev_cleanup(void);
+void dsr_dev_cleanup(void);
 
 #endif
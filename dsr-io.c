@@ -32,13 +32,19 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 	int mask = DSR_PKT_NONE;
 	struct in_addr myaddr = my_addr();
 	
-	/* Ignore packets that are originated by this node to avoid
-	 * poluting the link cache with old information that we keep
-	 * on genereating. */
-	if (dp->flags & PKT_PROMISC_RECV &&
-	    memcmp(&myaddr, &dp->src, sizeof(struct in_addr)) == 0) {
-		dsr_pkt_free(dp);
-		return 0;
+	if (dp->flags & PKT_PROMISC_RECV) {
+		/* Overhearing the next hop forward one of our buffered
+		 * packets acknowledges it */
+		if (ConfVal(TryPassiveAcks))
+			maint_buf_passive_ack(dp);
+
+		/* Ignore packets that are originated by this node to avoid
+		 * poluting the link cache with old information that we keep
+		 * on genereating. */
+		if (memcmp(&myaddr, &dp->src, sizeof(struct in_addr)) == 0) {
+			dsr_pkt_free(dp);
+			return 0;
+		}
 	}
 	
 	/* Process DSR Options */
@@ -89,7 +95,7 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 			}
 			break;
 		case DSR_PKT_FORWARD_RREQ:
-			XMIT(dp);
+			dsr_rreq_forward(dp);
 			return 0;
 		case DSR_PKT_SEND_RREP:
 			/* In dsr-rrep.c */
@@ -149,6 +155,11 @@ void NSCLASS dsr_start_xmit(struct dsr_pkt *dp)
 
 		return;
 
+	} else if (dsr_rreq_holdoff(dp->dst)) {
+		LOG_DBG("%s unreachable, dropping packet\n",
+			print_ip(dp->dst));
+		send_buf_drop_pkt(dp, 1);
+		return;
 	} else {
 #ifdef NS2
 		res = send_buf_enqueue_packet(dp, &DSRUU::ns_xmit);
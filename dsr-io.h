@@ -11,4 +11,24 @@
 int dsr_recv(struct dsr_pkt *dp);
 void dsr_start_xmit(struct dsr_pkt *dp);
 
+/* Received packets are processed in batches in the kernel, see
+ * dsr-module.c. ns-2 delivers them one at a time. */
+#ifdef __KERNEL__
+int dsr_rx_batch_seen(struct dsr_pkt *dp);
+int dsr_rx_batch_ack(struct in_addr neigh, unsigned short id);
+void dsr_rx_batch_ack_flush(void);
+#else
+#define dsr_rx_batch_seen(dp) 0
+#define dsr_rx_batch_ack(neigh, id) 0
+#define dsr_rx_batch_ack_flush()
+#endif
+
+/* Path MTU of originated packets, see dsr-dev.c. ns-2 packets have no
+ * size limit. */
+#ifdef __KERNEL__
+int dsr_pmtu_check(struct dsr_pkt *dp, int hdr_len);
+#else
+#define dsr_pmtu_check(dp, hdr_len) 0
+#endif
+
 #endif				/* _DSR_IO_H */
@@ -30,6 +30,8 @@
 #endif
 #include <net/icmp.h>
 #include <linux/ctype.h>
+#include <linux/interrupt.h>
+#include <linux/jhash.h>
 
 #include "dsr.h"
 #include "dsr-dev.h"
@@ -39,9 +41,11 @@
 #include "neigh.h"
 #include "dsr-rreq.h"
 #include "dsr-rrep.h"
+#include "dsr-ack.h"
 #include "maint-buf.h"
 #include "send-buf.h"
 #include "link-cache.h"
+#include "timer-wheel.h"
 
 static char *ifname = NULL;
 static char *mackill = NULL;
@@ -133,7 +137,7 @@ int do_mackill(char *mac)
 	return 0;
 }
 
-int dsr_ip_recv(struct sk_buff *skb)
+static void dsr_ip_recv_one(struct sk_buff *skb)
 {
 	struct dsr_pkt *dp;
 #ifdef ENABLE_DEBUG
@@ -146,7 +150,7 @@ int dsr_ip_recv(struct sk_buff *skb)
 	if (!dp) {
 		LOG_DBG("Could not allocate DSR packet\n");
 		dev_kfree_skb_any(skb);
-		return 0;
+		return;
 	}
 
 	if (skb->pkt_type == PACKET_OTHERHOST) {
@@ -157,7 +161,7 @@ int dsr_ip_recv(struct sk_buff *skb)
 		      skb->len + (dp->nh.iph->ihl << 2), 
 		      ntohs(dp->nh.iph->tot_len));
 		dsr_pkt_free(dp);
-		return 0;
+		return;
 	}
 
 /* 	LOG_DBG("iph_len=%d iph_totlen=%d dsr_opts_len=%d data_len=%d\n", */
@@ -166,10 +170,205 @@ int dsr_ip_recv(struct sk_buff *skb)
 
 	/* Add mac address of previous hop to the arp table */
 	dsr_recv(dp);
+}
 
-	return 0;
+/* Received DSR packets are put on a backlog of the CPU that they arrive on,
+ * and a tasklet processes them in batches, NAPI style. Packets of a batch
+ * that arrive from the same previous hop along the same source route update
+ * the neighbor table and the route cache only once, and the ACKs that a
+ * neighbor requests in a batch are sent as one. Deferred ACKs go to the ACK
+ * table before the next packet is built, so that it can carry them. */
+#define DSR_RX_BACKLOG_MAX 1000
+#define DSR_RX_BUDGET 64
+#define DSR_RX_BATCH_ROUTES 16
+#define DSR_RX_BATCH_ACKS 16
+
+struct dsr_rx_batch {
+	struct sk_buff_head backlog;
+	struct tasklet_struct tasklet;
+	int active;
+	int num_routes;
+	u32 routes[DSR_RX_BATCH_ROUTES];
+	int num_acks;
+	struct {
+		struct in_addr neigh;
+		unsigned short id;
+	} acks[DSR_RX_BATCH_ACKS];
 };
 
+static DEFINE_PER_CPU(struct dsr_rx_batch, dsr_rx_batch);
+static int dsr_rx_ready = 0;
+
+/* Returns 1 if a packet that came the same way was already seen in the
+ * current batch, otherwise remembers this one */
+int dsr_rx_batch_seen(struct dsr_pkt *dp)
+{
+	struct dsr_rx_batch *b = &per_cpu(dsr_rx_batch, smp_processor_id());
+	u32 key;
+	int i;
+
+	if (!b->active || !dp->srt)
+		return 0;
+
+	key = jhash(dp->srt->addrs, dp->srt->laddrs,
+		    jhash_3words(dp->src.s_addr, dp->dst.s_addr,
+				 dp->prv_hop.s_addr,
+				 dp->flags & PKT_PROMISC_RECV));
+
+	for (i = 0; i < b->num_routes; i++)
+		if (b->routes[i] == key)
+			return 1;
+
+	if (b->num_routes < DSR_RX_BATCH_ROUTES)
+		b->routes[b->num_routes++] = key;
+
+	return 0;
+}
+
+/* Defers an ACK to the end of the current batch. Returns 0 if there is no
+ * batch, or no room, in which case the caller sends it. */
+int dsr_rx_batch_ack(struct in_addr neigh, unsigned short id)
+{
+	struct dsr_rx_batch *b = &per_cpu(dsr_rx_batch, smp_processor_id());
+	int i;
+
+	if (!b->active)
+		return 0;
+
+	for (i = 0; i < b->num_acks; i++) {
+		if (b->acks[i].neigh.s_addr == neigh.s_addr) {
+			/* ACKs are cumulative */
+			if (dsr_ack_id_after(id, b->acks[i].id))
+				b->acks[i].id = id;
+			return 1;
+		}
+	}
+	if (b->num_acks == DSR_RX_BATCH_ACKS)
+		return 0;
+
+	b->acks[b->num_acks].neigh = neigh;
+	b->acks[b->num_acks].id = id;
+	b->num_acks++;
+
+	return 1;
+}
+
+/* Hand the ACKs deferred so far in the batch of this CPU to the ACK table.
+ * Called before a packet is built, so that it can carry them. */
+void dsr_rx_batch_ack_flush(void)
+{
+	struct dsr_rx_batch *b;
+	struct in_addr neigh[DSR_RX_BATCH_ACKS];
+	unsigned short id[DSR_RX_BATCH_ACKS];
+	int i, n;
+
+	local_bh_disable();
+
+	b = &per_cpu(dsr_rx_batch, smp_processor_id());
+
+	/* Sending an ACK may build a packet, so the ACKs are taken off the
+	 * batch before they are added */
+	n = b->num_acks;
+
+	for (i = 0; i < n; i++) {
+		neigh[i] = b->acks[i].neigh;
+		id[i] = b->acks[i].id;
+	}
+	b->num_acks = 0;
+
+	for (i = 0; i < n; i++)
+		ack_tbl_add(neigh[i], id[i]);
+
+	local_bh_enable();
+}
+
+static void dsr_rx_batch_run(unsigned long data)
+{
+	struct dsr_rx_batch *b = (struct dsr_rx_batch *)data;
+	struct sk_buff *skb;
+	int n = 0;
+
+	b->active = 1;
+	b->num_routes = 0;
+	b->num_acks = 0;
+
+	/* What the batch forwards goes to the slave together */
+	dsr_dev_tx_batch_begin();
+
+	while (n < DSR_RX_BUDGET && (skb = skb_dequeue(&b->backlog))) {
+		dsr_ip_recv_one(skb);
+		n++;
+	}
+	b->active = 0;
+
+	dsr_rx_batch_ack_flush();
+
+	dsr_dev_tx_batch_flush();
+
+	/* Let others run before the rest of the backlog */
+	if (!skb_queue_empty(&b->backlog))
+		tasklet_schedule(&b->tasklet);
+}
+
+int dsr_ip_recv(struct sk_buff *skb)
+{
+	struct dsr_rx_batch *b = &per_cpu(dsr_rx_batch, smp_processor_id());
+
+	/* Nothing is queued until everything that the tasklet uses is set
+	 * up, so a failed module load never has packets to clean up */
+	if (!dsr_rx_ready) {
+		dev_kfree_skb_any(skb);
+		return 0;
+	}
+
+	if (skb_queue_len(&b->backlog) >= DSR_RX_BACKLOG_MAX) {
+		LOG_DBG("Receive backlog full, dropping\n");
+		dev_kfree_skb_any(skb);
+		return 0;
+	}
+	skb_queue_tail(&b->backlog, skb);
+	tasklet_schedule(&b->tasklet);
+
+	return 0;
+}
+
+static void dsr_rx_batch_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct dsr_rx_batch *b = &per_cpu(dsr_rx_batch, cpu);
+
+		skb_queue_head_init(&b->backlog);
+		tasklet_init(&b->tasklet, dsr_rx_batch_run, (unsigned long)b);
+		b->active = 0;
+		b->num_routes = 0;
+		b->num_acks = 0;
+	}
+}
+
+static void dsr_rx_batch_cleanup(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct dsr_rx_batch *b = &per_cpu(dsr_rx_batch, cpu);
+
+		tasklet_kill(&b->tasklet);
+		skb_queue_purge(&b->backlog);
+	}
+}
+
+/* Stop receiving DSR packets from the slave and wait for the packets
+ * already taken in. The protocol handler and the netfilter hooks must be
+ * gone. */
+static void dsr_rx_stop(void)
+{
+	dsr_dev_rx_stop();
+	synchronize_net();
+	dsr_rx_batch_cleanup();
+}
+
 static void dsr_ip_recv_err(struct sk_buff *skb, u32 info)
 {
 	LOG_DBG("received error, info=%u\n", info);
@@ -266,6 +465,9 @@ static int dsr_config_proc_write(struct file *file, const char *buffer,
 			if (i == SendBufferSize)
 				send_buf_set_max_len(val);
 
+			if (i == NeighborTableSize)
+				neigh_tbl_set_max_len(val);
+
 			LOG_DBG("Setting %s to %d\n", confvals_def[i].name, val);
 		}
 	}
@@ -365,12 +567,23 @@ static int __init dsr_module_init(void)
 	dbg_init();
 #endif
 	parse_mackill();
-	
+
+	timer_wheel_init();
+	dsr_rx_batch_init();
+
+	res = dsr_pkt_cache_init();
+
+	if (res < 0) {
+		timer_wheel_cleanup();
+		return res;
+	}
+
 	res = dsr_dev_init(ifname);
 
 	if (res < 0) {
 		LOG_DBG("dsr-dev init failed\n");
-		return -EAGAIN;
+		res = -EAGAIN;
+		goto cleanup_pkt_cache;
 	}
 
 	res = send_buf_init();
@@ -393,20 +606,27 @@ static int __init dsr_module_init(void)
 	if (res < 0)
 		goto cleanup_rreq_tbl;
 
-	res = nf_register_hook(&dsr_pre_routing_hook);
+	res = maint_buf_init();
 
 	if (res < 0)
 		goto cleanup_neigh_tbl;
 
-	res = nf_register_hook(&dsr_ip_forward_hook);
+	res = ack_tbl_init();
 
 	if (res < 0)
-		goto cleanup_nf_hook2;
+		goto cleanup_maint_buf;
 
-	res = maint_buf_init();
+	/* The hooks come last, when everything that the receive path uses
+	 * is in place */
+	res = nf_register_hook(&dsr_pre_routing_hook);
 
 	if (res < 0)
-		goto cleanup_nf_hook1;
+		goto cleanup_ack_tbl;
+
+	res = nf_register_hook(&dsr_ip_forward_hook);
+
+	if (res < 0)
+		goto cleanup_nf_hook2;
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
 #define proc_net init_net.proc_net
@@ -414,7 +634,7 @@ static int __init dsr_module_init(void)
 	proc = create_proc_entry(CONFIG_PROC_NAME, S_IRUGO | S_IWUSR, proc_net);
 
 	if (!proc)
-		goto cleanup_maint_buf;
+		goto cleanup_nf_hook1;
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30))
 	proc->owner = THIS_MODULE;
@@ -424,6 +644,7 @@ static int __init dsr_module_init(void)
 
 #ifndef KERNEL26
 	inet_add_protocol(&dsr_inet_prot);
+	dsr_rx_ready = 1;
 	LOG_DBG("Setup finished\n");
 	return 0;
 #else
@@ -434,6 +655,8 @@ static int __init dsr_module_init(void)
 		goto cleanup_proc;
 	}
 
+	dsr_rx_ready = 1;
+
 	LOG_DBG("Setup finished res=%d\n", res);
 
 	return 0;
@@ -446,12 +669,14 @@ cleanup_proc:
 
 #endif /* KERNEL26 */
 
-cleanup_maint_buf:
-	maint_buf_cleanup();
 cleanup_nf_hook1:
 	nf_unregister_hook(&dsr_ip_forward_hook);
 cleanup_nf_hook2:
 	nf_unregister_hook(&dsr_pre_routing_hook);
+cleanup_ack_tbl:
+	ack_tbl_cleanup();
+cleanup_maint_buf:
+	maint_buf_cleanup();
 cleanup_neigh_tbl:
 	neigh_tbl_cleanup();
 cleanup_grat_rrep_tbl:
@@ -461,7 +686,11 @@ cleanup_rreq_tbl:
 cleanup_send_buf:
 	send_buf_cleanup();
 cleanup_dsr_dev:
+	dsr_rx_stop();
 	dsr_dev_cleanup();
+cleanup_pkt_cache:
+	dsr_pkt_cache_cleanup();
+	timer_wheel_cleanup();
 #ifdef DEBUG
 	dbg_cleanup();
 #endif
@@ -477,6 +706,10 @@ static void __exit dsr_module_cleanup(void)
 #endif
 	nf_unregister_hook(&dsr_pre_routing_hook);
 	nf_unregister_hook(&dsr_ip_forward_hook);
+
+	/* Nothing is queued for the tasklets after this */
+	dsr_rx_stop();
+
 	dsr_dev_cleanup();
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
 	proc_net_remove(CONFIG_PROC_NAME);
@@ -487,7 +720,10 @@ static void __exit dsr_module_cleanup(void)
 	grat_rrep_tbl_cleanup();
 	neigh_tbl_cleanup();
 	maint_buf_cleanup();
+	ack_tbl_cleanup();
 	send_buf_cleanup();
+	dsr_pkt_cache_cleanup();
+	timer_wheel_cleanup();
 #ifdef DEBUG
 	dbg_cleanup();
 #endif
@@ -41,6 +41,9 @@ struct dsr_opt_hdr *dsr_opt_hdr_add(char *buf, unsigned int len,
 }
 
 #ifdef __KERNEL__
+/* A header that is copied from the skb is already checksummed, so only the
+ * fields that change are summed again, as in RFC 1624. A new header is
+ * summed in full. */
 struct iphdr *dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 			   struct in_addr dst, int ip_len, int tot_len,
 			   int protocol, int ttl)
@@ -51,17 +54,31 @@ struct iphdr *dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 	
 	if (dp->skb && SKB_NETWORK_HDR_RAW(dp->skb)) {
 		memcpy(dp->ip_data, SKB_NETWORK_HDR_RAW(dp->skb), ip_len);
-	} else {
-		iph->version = IPVERSION;
-		iph->ihl = 5;
-		iph->tos = 0;
-		iph->id = 0;
-		iph->frag_off = 0;
-		iph->ttl = (ttl ? ttl : IPDEFTTL);
-		iph->saddr = src.s_addr;
-		iph->daddr = dst.s_addr;
+
+		if (iph->tot_len != htons(tot_len)) {
+			csum_replace2(&iph->check, iph->tot_len,
+				      htons(tot_len));
+			iph->tot_len = htons(tot_len);
+		}
+		if (iph->protocol != protocol) {
+			/* The protocol shares a 16 bit word with the TTL */
+			u_int16_t *word = (u_int16_t *)&iph->ttl;
+			u_int16_t old = *word;
+
+			iph->protocol = protocol;
+			csum_replace2(&iph->check, old, *word);
+		}
+		return iph;
 	}
-	
+
+	iph->version = IPVERSION;
+	iph->ihl = 5;
+	iph->tos = 0;
+	iph->id = 0;
+	iph->frag_off = 0;
+	iph->ttl = (ttl ? ttl : IPDEFTTL);
+	iph->saddr = src.s_addr;
+	iph->daddr = dst.s_addr;
 	iph->tot_len = htons(tot_len);
 	iph->protocol = protocol;
 
@@ -73,20 +90,14 @@ struct iphdr *dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 
 struct dsr_opt *dsr_opt_find_opt(struct dsr_pkt *dp, int type)
 {
-	int dsr_len, l;
 	struct dsr_opt *dopt;
+	int i;
 
-	dsr_len = dsr_pkt_opts_len(dp);
-
-	l = DSR_OPT_HDR_LEN;
-	dopt = DSR_GET_OPT(dp->dh.opth);
+	for (i = 0; i < dp->num_opts; i++) {
+		dopt = (struct dsr_opt *)(dp->dh.raw + dp->opt_off[i]);
 
-	while (l < dsr_len && (dsr_len - l) > 2) {
 		if (type == dopt->type)
 			return dopt;
-
-		l += dopt->length + 2;
-		dopt = DSR_GET_NEXT_OPT(dopt);
 	}
 	return NULL;
 }
@@ -115,9 +126,68 @@ int NSCLASS dsr_opt_remove(struct dsr_pkt *dp)
 	return len;
 }
 
+/* Remove all options of a type from a packet, e.g., ACKs that were consumed
+ * by this node before the packet is forwarded. Returns bytes removed. */
+int NSCLASS dsr_opt_del(struct dsr_pkt *dp, int type)
+{
+	int dsr_len, l, len, removed = 0;
+	struct dsr_opt *dopt;
+
+	if (!dp || !dp->dh.raw)
+		return 0;
+
+	if (!dsr_opt_find_opt(dp, type))
+		return 0;
+
+	if (dsr_pkt_opts_cow(dp) < 0)
+		return 0;
+
+	dsr_len = dsr_pkt_opts_len(dp);
+
+	l = DSR_OPT_HDR_LEN;
+	dopt = DSR_GET_OPT(dp->dh.opth);
+
+	while (l < dsr_len && (dsr_len - l) > 2) {
+		if (dopt->type == DSR_OPT_PAD1) {
+			l++;
+			dopt = (struct dsr_opt *)((char *)dopt + 1);
+			continue;
+		}
+		len = dopt->length + 2;
+
+		if (dopt->type == type) {
+			memmove(dopt, (char *)dopt + len, dsr_len - l - len);
+			dsr_len -= len;
+			removed += len;
+			continue;
+		}
+		l += len;
+		dopt = DSR_GET_NEXT_OPT(dopt);
+	}
+
+	if (!removed)
+		return 0;
+
+	dp->dh.tail -= removed;
+	dp->dh.opth->p_len = htons(dsr_len - DSR_OPT_HDR_LEN);
+#ifndef NS2
+	dsr_build_ip(dp, dp->src, dp->dst, dp->nh.iph->ihl << 2,
+		     ntohs(dp->nh.iph->tot_len) - removed, IPPROTO_DSR,
+		     dp->nh.iph->ttl);
+#endif
+	/* Options following the removed ones have moved */
+	dsr_opt_parse(dp);
+
+	return removed;
+}
+
+/* Index the options of a packet in one pass, checking that each of them is
+ * within the options header. The index is what dsr_opt_recv() walks, and
+ * the per type pointers are set from it. Returns the number of options, or
+ * -1 if they are malformed. */
 int dsr_opt_parse(struct dsr_pkt *dp)
 {
-	int dsr_len, l, n = 0;
+	int dsr_len, l, len, n = 0;
 	struct dsr_opt *dopt;
 
 	if (!dp)
@@ -125,26 +195,56 @@ int dsr_opt_parse(struct dsr_pkt *dp)
 
 	dsr_len = dsr_pkt_opts_len(dp);
 
-	l = DSR_OPT_HDR_LEN;
-	dopt = DSR_GET_OPT(dp->dh.opth);
-	
 	dp->num_rrep_opts = dp->num_rerr_opts = dp->num_rreq_opts = dp->num_ack_opts = 0;
+	dp->num_opts = 0;
 	
 	dp->srt_opt = NULL;
+	dp->rreq_opt = NULL;
+	dp->rreq_trg_opt = NULL;
 	dp->ack_req_opt = NULL;
 
-	while (l < dsr_len && (dsr_len - l) > 2) {
+	for (l = DSR_OPT_HDR_LEN; l < dsr_len && (dsr_len - l) > 2; l += len) {
+		dopt = (struct dsr_opt *)(dp->dh.raw + l);
+
+		if (dopt->type == DSR_OPT_PAD1) {
+			len = DSR_OPT_PAD1_LEN;
+			continue;
+		}
+		len = dopt->length + 2;
+
+		if (l + len > dsr_len) {
+#ifndef NS2
+			LOG_DBG("Option type=%d overruns the DSR header\n",
+				dopt->type);
+#endif
+			return -1;
+		}
+		n++;
+
+		if (dopt->type == DSR_OPT_PADN)
+			continue;
+
+		if (dp->num_opts == MAX_DSR_OPTS) {
+#ifndef NS2
+			LOG_DBG("Maximum number of DSR options reached\n");
+#endif
+			return -1;
+		}
+		dp->opt_off[dp->num_opts++] = l;
+
 		switch (dopt->type) {
-		case DSR_OPT_PADN:
-			break;
 		case DSR_OPT_RREQ:
-			if (dp->num_rreq_opts == 0)
+			if (!dp->rreq_opt)
 				dp->rreq_opt = (struct dsr_rreq_opt *)dopt;
 #ifndef NS2
 			else
 				LOG_DBG("ERROR: More than one RREQ option!!\n");
 #endif
 			break;
+		case DSR_OPT_RREQ_TRG:
+			if (!dp->rreq_trg_opt)
+				dp->rreq_trg_opt = (struct dsr_rreq_trg_opt *)dopt;
+			break;
 		case DSR_OPT_RREP:
 			if (dp->num_rrep_opts < MAX_RREP_OPTS)
 				dp->rrep_opt[dp->num_rrep_opts++] = (struct dsr_rrep_opt *)dopt;
@@ -161,8 +261,6 @@ int dsr_opt_parse(struct dsr_pkt *dp)
 				LOG_DBG("Maximum RERR opts in one packet reached\n");
 #endif
 			break;
-		case DSR_OPT_PREV_HOP:
-			break;
 		case DSR_OPT_ACK:
 			if (dp->num_ack_opts < MAX_ACK_OPTS)
 				dp->ack_opt[dp->num_ack_opts++] = (struct dsr_ack_opt *)dopt;
@@ -179,10 +277,6 @@ int dsr_opt_parse(struct dsr_pkt *dp)
 				LOG_DBG("More than one source route in packet\n");
 #endif
 			break;
-		case DSR_OPT_TIMEOUT:
-			break;
-		case DSR_OPT_FLOWID:
-			break;
 		case DSR_OPT_ACK_REQ:
 			if (!dp->ack_req_opt)
 				dp->ack_req_opt = (struct dsr_ack_req_opt *)dopt;
@@ -191,18 +285,7 @@ int dsr_opt_parse(struct dsr_pkt *dp)
 				LOG_DBG("More than one ACK REQ in packet\n");
 #endif
 			break;
-		case DSR_OPT_PAD1:
-			l++;
-			dopt++;
-			continue;
-#ifndef NS2
-		default:
-			LOG_DBG("Unknown DSR option type=%d\n", dopt->type);
-#endif
 		}
-		l += dopt->length + 2;
-		dopt = DSR_GET_NEXT_OPT(dopt);
-		n++;
 	}
 	
 	return n;
@@ -210,7 +293,7 @@ int dsr_opt_parse(struct dsr_pkt *dp)
 
 int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 {
-	int dsr_len, l;
+	int i;
 	int action = 0;
 	struct dsr_opt *dopt;
 	struct in_addr myaddr;
@@ -231,24 +314,22 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 	if (dp->dst.s_addr == myaddr.s_addr && dp->payload_len != 0)
 		action |= DSR_PKT_DELIVER;
 #endif
-	dsr_len = dsr_pkt_opts_len(dp);
-
-	l = DSR_OPT_HDR_LEN;
-	dopt = DSR_GET_OPT(dp->dh.opth);
+	/* The options are walked through the index built by dsr_opt_parse().
+	 * Handlers may move the options, so each one is looked up from its
+	 * offset. */
+	for (i = 0; i < dp->num_opts; i++) {
+		dopt = (struct dsr_opt *)(dp->dh.raw + dp->opt_off[i]);
 
-	//LOG_DBG("Parsing DSR packet l=%d dsr_len=%d\n", l, dsr_len);
-	
-	while (l < dsr_len && (dsr_len - l) > 2) {
-		//LOG_DBG("dsr_len=%d l=%d\n", dsr_len, l);
 		switch (dopt->type) {
-		case DSR_OPT_PADN:
-			break;
 		case DSR_OPT_RREQ:
 			if (dp->flags & PKT_PROMISC_RECV)
 				break;
 			
 			action |= dsr_rreq_opt_recv(dp, (struct dsr_rreq_opt *)dopt);
 			break;
+		case DSR_OPT_RREQ_TRG:
+			/* Handled together with the RREQ that follows */
+			break;
 		case DSR_OPT_RREP:
 			/* We should probably allow promisuously
 			 * receiving RREPs */
@@ -272,13 +353,7 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 			if (dp->flags & PKT_PROMISC_RECV)
 				break;
 
-			if (dp->num_ack_opts < MAX_ACK_OPTS) {
-				dp->ack_opt[dp->num_ack_opts++] =
-				    (struct dsr_ack_opt *)dopt;
-				action |=
-				    dsr_ack_opt_recv((struct dsr_ack_opt *)
-						     dopt);
-			}
+			action |= dsr_ack_opt_recv((struct dsr_ack_opt *)dopt);
 			break;
 		case DSR_OPT_SRT:
 			action |= dsr_srt_opt_recv(dp, (struct dsr_srt_opt *)dopt);
@@ -292,15 +367,9 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 			    dsr_ack_req_opt_recv(dp, (struct dsr_ack_req_opt *)
 						 dopt);
 			break;
-		case DSR_OPT_PAD1:
-			l++;
-			dopt++;
-			continue;
 		default:
 			LOG_DBG("Unknown DSR option type=%d\n", dopt->type);
 		}
-		l += dopt->length + 2;
-		dopt = DSR_GET_NEXT_OPT(dopt);
 	}
 	return action;
 }
@@ -76,6 +76,7 @@ struct dsr_pad1_opt {
 #define DSR_OPT_RREP       1
 #define DSR_OPT_RREQ       2
 #define DSR_OPT_RERR       3
+#define DSR_OPT_RREQ_TRG   4	/* Experimental, see dsr-rreq.h */
 #define DSR_OPT_PREV_HOP   5
 #define DSR_OPT_ACK       32
 #define DSR_OPT_SRT       96
@@ -97,6 +98,13 @@ int dsr_opt_parse(struct dsr_pkt *dp);
 struct iphdr *dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 			   struct in_addr dst, int ip_len, int totlen,
 			   int protocol, int ttl);
+
+/* Set the destination of an IP header that is already checksummed */
+static inline void dsr_ip_set_daddr(struct iphdr *iph, u_int32_t daddr)
+{
+	csum_replace4(&iph->check, iph->daddr, daddr);
+	iph->daddr = daddr;
+}
 #endif
 
 #endif				/* NO_GLOBALS */
@@ -104,6 +112,7 @@ struct iphdr *dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 #ifndef NO_DECLS
 
 int dsr_opt_remove(struct dsr_pkt *dp);
+int dsr_opt_del(struct dsr_pkt *dp, int type);
 int dsr_opt_recv(struct dsr_pkt *dp);
 
 #endif				/* NO_DECLS */
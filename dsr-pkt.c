@@ -5,7 +5,9 @@
  *
  * Author: Erik Nordström, <erikn@it.uu.se>
  */
-#ifdef __KERNEL_
+#ifdef __KERNEL__
+#include <linux/version.h>
+#include <linux/slab.h>
 #include <linux/skbuff.h>
 #include <linux/if_ether.h>
 #endif
@@ -18,26 +20,184 @@
 #include "dsr-opt.h"
 #include "dsr.h"
 
+/* Packets and option buffers of the common size are recycled through slab
+ * caches in the kernel, and through free lists in ns-2. Option buffers of
+ * other sizes are kmalloc'ed. */
+#ifdef __KERNEL__
+static struct kmem_cache *dsr_pkt_cache;
+static struct kmem_cache *dsr_opts_cache;
+#else
+#define DSR_FREE_LIST_MAX 256
+
+static void *dsr_pkt_free_list;
+static void *dsr_opts_free_list;
+static int dsr_pkt_free_len;
+static int dsr_opts_free_len;
+
+static inline void *free_list_get(void **list, int *len)
+{
+	void *obj = *list;
+
+	if (obj) {
+		*list = *(void **)obj;
+		(*len)--;
+	}
+	return obj;
+}
+
+static inline int free_list_put(void **list, int *len, void *obj)
+{
+	if (*len >= DSR_FREE_LIST_MAX)
+		return 0;
+
+	*(void **)obj = *list;
+	*list = obj;
+	(*len)++;
+
+	return 1;
+}
+#endif
+
+static char *dsr_opts_buf_alloc(int size)
+{
+	if (size != DSR_OPTS_BUF_SIZE)
+		return (char *)kmalloc(size, GFP_ATOMIC);
+#ifdef __KERNEL__
+	return (char *)kmem_cache_alloc(dsr_opts_cache, GFP_ATOMIC);
+#else
+	if (dsr_opts_free_list)
+		return (char *)free_list_get(&dsr_opts_free_list,
+					     &dsr_opts_free_len);
+
+	return (char *)kmalloc(size, GFP_ATOMIC);
+#endif
+}
+
+void dsr_opts_buf_free(char *buf, int size)
+{
+	if (size != DSR_OPTS_BUF_SIZE) {
+		kfree(buf);
+		return;
+	}
+#ifdef __KERNEL__
+	kmem_cache_free(dsr_opts_cache, buf);
+#else
+	if (!free_list_put(&dsr_opts_free_list, &dsr_opts_free_len, buf))
+		kfree(buf);
+#endif
+}
+
+/* Allocate a packet and initialize the fields that are read before they
+ * are set. The option pointer arrays are only valid up to their counts, and
+ * are left as they are. */
+static struct dsr_pkt *__dsr_pkt_alloc(void)
+{
+	struct dsr_pkt *dp;
+
+#ifdef __KERNEL__
+	dp = (struct dsr_pkt *)kmem_cache_alloc(dsr_pkt_cache, GFP_ATOMIC);
+#else
+	dp = (struct dsr_pkt *)free_list_get(&dsr_pkt_free_list,
+					     &dsr_pkt_free_len);
+	if (!dp)
+		dp = (struct dsr_pkt *)kmalloc(sizeof(struct dsr_pkt),
+					       GFP_ATOMIC);
+#endif
+	if (!dp)
+		return NULL;
+
+	dp->src.s_addr = dp->dst.s_addr = 0;
+	dp->nxt_hop.s_addr = dp->prv_hop.s_addr = 0;
+	dp->flags = 0;
+	dp->salvage = 0;
+	dp->mac.raw = NULL;
+	dp->nh.raw = NULL;
+	dp->dh.raw = dp->dh.tail = dp->dh.end = NULL;
+	dp->num_rrep_opts = dp->num_rerr_opts = 0;
+	dp->num_rreq_opts = dp->num_ack_opts = 0;
+	dp->srt_opt = NULL;
+	dp->rreq_opt = NULL;
+	dp->rreq_trg_opt = NULL;
+	dp->ack_req_opt = NULL;
+	dp->num_opts = 0;
+	dp->srt = NULL;
+	dp->payload_len = 0;
+	dp->payload = NULL;
+#ifdef NS2
+	dp->p = NULL;
+#else
+	dp->skb = NULL;
+#endif
+	return dp;
+}
+
+static void __dsr_pkt_free(struct dsr_pkt *dp)
+{
+#ifdef __KERNEL__
+	kmem_cache_free(dsr_pkt_cache, dp);
+#else
+	if (!free_list_put(&dsr_pkt_free_list, &dsr_pkt_free_len, dp))
+		kfree(dp);
+#endif
+}
+
 char *dsr_pkt_alloc_opts(struct dsr_pkt *dp, int len)
 {
+	int size = len + DEFAULT_TAILROOM;
+
 	if (!dp)
 		return NULL;
 
-	dp->dh.raw = (char *)kmalloc(len + DEFAULT_TAILROOM, GFP_ATOMIC);
+	/* Use the common buffer size whenever the options fit */
+	if (size < DSR_OPTS_BUF_SIZE)
+		size = DSR_OPTS_BUF_SIZE;
+
+	dp->dh.raw = dsr_opts_buf_alloc(size);
 
 	if (!dp->dh.raw)
 		return NULL;
 
 	dp->dh.tail = dp->dh.raw + len;
-	dp->dh.end = dp->dh.tail + DEFAULT_TAILROOM;
+	dp->dh.end = dp->dh.raw + size;
+	dp->flags &= ~PKT_OPTS_IN_SKB;
 
 	return dp->dh.raw;
 }
 
+static inline void *opt_rebase(void *opt, long delta)
+{
+	return opt ? (char *)opt + delta : NULL;
+}
+
+/* Move the option pointers of a packet along with its options, which have
+ * been copied from the buffer at old to dh.raw */
+static void dsr_pkt_opts_rebase(struct dsr_pkt *dp, char *old)
+{
+	long delta = dp->dh.raw - old;
+	int i;
+
+	dp->srt_opt = (struct dsr_srt_opt *)opt_rebase(dp->srt_opt, delta);
+	dp->rreq_opt = (struct dsr_rreq_opt *)opt_rebase(dp->rreq_opt, delta);
+	dp->rreq_trg_opt =
+	    (struct dsr_rreq_trg_opt *)opt_rebase(dp->rreq_trg_opt, delta);
+	dp->ack_req_opt =
+	    (struct dsr_ack_req_opt *)opt_rebase(dp->ack_req_opt, delta);
+
+	for (i = 0; i < dp->num_rrep_opts; i++)
+		dp->rrep_opt[i] =
+		    (struct dsr_rrep_opt *)opt_rebase(dp->rrep_opt[i], delta);
+	for (i = 0; i < dp->num_rerr_opts; i++)
+		dp->rerr_opt[i] =
+		    (struct dsr_rerr_opt *)opt_rebase(dp->rerr_opt[i], delta);
+	for (i = 0; i < dp->num_ack_opts; i++)
+		dp->ack_opt[i] =
+		    (struct dsr_ack_opt *)opt_rebase(dp->ack_opt[i], delta);
+}
+
 char *dsr_pkt_alloc_opts_expand(struct dsr_pkt *dp, int len)
 {
 	char *tmp;
-	int old_len;
+	int old_len, old_size, in_skb;
 
 	if (!dp || !dp->dh.raw)
 		return NULL;
@@ -50,17 +210,51 @@ char *dsr_pkt_alloc_opts_expand(struct dsr_pkt *dp, int len)
 
 	tmp = dp->dh.raw;
 	old_len = dsr_pkt_opts_len(dp);
+	old_size = dp->dh.end - dp->dh.raw;
+	in_skb = dp->flags & PKT_OPTS_IN_SKB;
 
-	if (!dsr_pkt_alloc_opts(dp, old_len + len))
+	if (!dsr_pkt_alloc_opts(dp, old_len + len)) {
+		dp->dh.raw = tmp;
 		return NULL;
+	}
 
 	memcpy(dp->dh.raw, tmp, old_len);
 
-	kfree(tmp);
+	/* Options in the skb have no tailroom and always end up here */
+	if (!in_skb)
+		dsr_opts_buf_free(tmp, old_size);
+
+	dsr_pkt_opts_rebase(dp, tmp);
 	
 	return (dp->dh.raw + old_len);
 }
 
+/* Make the options of a packet writable. Options that are parsed in place
+ * in a received skb are copied into a buffer of their own first. The option
+ * pointers of the packet are moved along, while pointers held by the caller
+ * must be reloaded. Returns 0 on success. */
+int dsr_pkt_opts_cow(struct dsr_pkt *dp)
+{
+	char *old;
+	int len;
+
+	if (!dp || !(dp->flags & PKT_OPTS_IN_SKB))
+		return 0;
+
+	old = dp->dh.raw;
+	len = dsr_pkt_opts_len(dp);
+
+	if (!dsr_pkt_alloc_opts(dp, len)) {
+		dp->dh.raw = old;
+		return -1;
+	}
+	memcpy(dp->dh.raw, old, len);
+
+	dsr_pkt_opts_rebase(dp, old);
+
+	return 0;
+}
+
 int dsr_pkt_free_opts(struct dsr_pkt *dp)
 {
 	int len;
@@ -69,16 +263,22 @@ int dsr_pkt_free_opts(struct dsr_pkt *dp)
 		return -1;
 
 	len = dsr_pkt_opts_len(dp);
-	
-	kfree(dp->dh.raw);
+
+	/* Options in the skb go with it */
+	if (dp->flags & PKT_OPTS_IN_SKB)
+		dp->flags &= ~PKT_OPTS_IN_SKB;
+	else
+		dsr_opts_buf_free(dp->dh.raw, dp->dh.end - dp->dh.raw);
 
 	dp->dh.raw = dp->dh.end = dp->dh.tail = NULL;
 	dp->srt_opt = NULL;
 	dp->rreq_opt = NULL;
+	dp->rreq_trg_opt = NULL;
 	memset(dp->rrep_opt, 0, sizeof(struct dsr_rrep_opt *) * MAX_RREP_OPTS);
 	memset(dp->rerr_opt, 0, sizeof(struct dsr_rerr_opt *) * MAX_RERR_OPTS);
 	memset(dp->ack_opt, 0, sizeof(struct dsr_ack_opt *) * MAX_ACK_OPTS);
 	dp->num_rrep_opts = dp->num_rerr_opts = dp->num_ack_opts = 0;
+	dp->num_opts = 0;
 
 	return len;
 }
@@ -90,13 +290,11 @@ struct dsr_pkt *dsr_pkt_alloc(Packet * p)
 	struct hdr_cmn *cmh;
 	int dsr_opts_len = 0;
 
-	dp = (struct dsr_pkt *)kmalloc(sizeof(struct dsr_pkt), GFP_ATOMIC);
+	dp = __dsr_pkt_alloc();
 
 	if (!dp)
 		return NULL;
 
-	memset(dp, 0, sizeof(struct dsr_pkt));
-
 	if (p) {
 		cmh = hdr_cmn::access(p);
 
@@ -117,7 +315,7 @@ struct dsr_pkt *dsr_pkt_alloc(Packet * p)
 			dsr_opts_len = opth->p_len + DSR_OPT_HDR_LEN;
 
 			if (!dsr_pkt_alloc_opts(dp, dsr_opts_len)) {
-				kfree(dp);
+				__dsr_pkt_free(dp);
 				return NULL;
 			}
 
@@ -147,13 +345,11 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb)
 	struct dsr_pkt *dp;
 	int dsr_opts_len = 0;
 
-	dp = (struct dsr_pkt *)kmalloc(sizeof(struct dsr_pkt), GFP_ATOMIC);
+	dp = __dsr_pkt_alloc();
 
 	if (!dp)
 		return NULL;
 
-	memset(dp, 0, sizeof(struct dsr_pkt));
-
 	if (skb) {
 	/* 	skb_unlink(skb); */
 
@@ -167,22 +363,35 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb)
 
 		if (dp->nh.iph->protocol == IPPROTO_DSR) {
 			struct dsr_opt_hdr *opth;
-			int n;
+			int n, ip_len = dp->nh.iph->ihl << 2;
+
+			opth = (struct dsr_opt_hdr *)(dp->nh.raw + ip_len);
 
-			opth = (struct dsr_opt_hdr *)(dp->nh.raw + (dp->nh.iph->ihl << 2));
-		
+			if ((unsigned char *)opth + DSR_OPT_HDR_LEN >
+			    SKB_TAIL(skb))
+				goto out_err;
 
 			dsr_opts_len = ntohs(opth->p_len) + DSR_OPT_HDR_LEN;
 
-			if (!dsr_pkt_alloc_opts(dp, dsr_opts_len)) {
-				kfree(dp);
-				return NULL;
+			if ((unsigned char *)opth + dsr_opts_len > SKB_TAIL(skb) ||
+			    ip_len + dsr_opts_len > ntohs(dp->nh.iph->tot_len)) {
+				LOG_DBG("DSR options overrun the packet\n");
+				goto out_err;
 			}
 
-			memcpy(dp->dh.raw, (char *)opth, dsr_opts_len);
-			
+			/* The options are parsed where they are in the skb,
+			 * and only copied if they are rewritten, see
+			 * dsr_pkt_opts_cow() */
+			dp->dh.raw = (char *)opth;
+			dp->dh.tail = dp->dh.end = dp->dh.raw + dsr_opts_len;
+			dp->flags |= PKT_OPTS_IN_SKB;
+
 			n = dsr_opt_parse(dp);
-			
+
+			if (n < 0) {
+				LOG_DBG("Malformed DSR options\n");
+				goto out_err;
+			}
 			LOG_DBG("Packet has %d DSR option(s)\n", n);
 		}
 
@@ -196,6 +405,10 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb)
 			dp->flags |= PKT_REQUEST_ACK;
 	}
 	return dp;
+      out_err:
+	/* The skb stays with the caller */
+	__dsr_pkt_free(dp);
+	return NULL;
 }
 
 #endif
@@ -214,7 +427,39 @@ void dsr_pkt_free(struct dsr_pkt *dp)
 	if (dp->srt)
 		kfree(dp->srt);
 
-	kfree(dp);
+	__dsr_pkt_free(dp);
 
 	return;
 }
+
+#ifdef __KERNEL__
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+#define DSR_KMEM_CACHE_CREATE(name, size) \
+	kmem_cache_create(name, size, 0, SLAB_HWCACHE_ALIGN, NULL, NULL)
+#else
+#define DSR_KMEM_CACHE_CREATE(name, size) \
+	kmem_cache_create(name, size, 0, SLAB_HWCACHE_ALIGN, NULL)
+#endif
+
+int __init dsr_pkt_cache_init(void)
+{
+	dsr_pkt_cache = DSR_KMEM_CACHE_CREATE("dsr_pkt",
+					      sizeof(struct dsr_pkt));
+	if (!dsr_pkt_cache)
+		return -ENOMEM;
+
+	dsr_opts_cache = DSR_KMEM_CACHE_CREATE("dsr_opts", DSR_OPTS_BUF_SIZE);
+
+	if (!dsr_opts_cache) {
+		kmem_cache_destroy(dsr_pkt_cache);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void dsr_pkt_cache_cleanup(void)
+{
+	kmem_cache_destroy(dsr_opts_cache);
+	kmem_cache_destroy(dsr_pkt_cache);
+}
+#endif
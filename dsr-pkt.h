@@ -18,8 +18,10 @@
 #define MAX_RREP_OPTS 10
 #define MAX_RERR_OPTS 10
 #define MAX_ACK_OPTS  10
+#define MAX_DSR_OPTS  40	/* Options in the index, padding excluded */
 
 #define DEFAULT_TAILROOM 128
+#define DSR_OPTS_BUF_SIZE (DEFAULT_TAILROOM + 128)	/* Common option buffer */
 
 /* Internal representation of a packet. For portability */
 struct dsr_pkt {
@@ -57,10 +59,16 @@ struct dsr_pkt {
 		};		
 		char *tail, *end;  
 	} dh;
+
+	/* Option index, in packet order, built by dsr_opt_parse(). Offsets
+	 * are from dh.raw, so they stay valid when the options move. */
+	unsigned short opt_off[MAX_DSR_OPTS];
+	int num_opts;
 		
 	int num_rrep_opts, num_rerr_opts, num_rreq_opts, num_ack_opts;
 	struct dsr_srt_opt *srt_opt;
 	struct dsr_rreq_opt *rreq_opt;	/* Can only be one */
+	struct dsr_rreq_trg_opt *rreq_trg_opt;
 	struct dsr_rrep_opt *rrep_opt[MAX_RREP_OPTS];
 	struct dsr_rerr_opt *rerr_opt[MAX_RERR_OPTS];
 	struct dsr_ack_opt *ack_opt[MAX_ACK_OPTS];
@@ -84,6 +92,7 @@ struct dsr_pkt {
 #define PKT_REQUEST_ACK  0x02
 #define PKT_PASSIVE_ACK  0x04
 #define PKT_XMIT_JITTER  0x08
+#define PKT_OPTS_IN_SKB  0x10	/* Options point into the skb, read only */
 
 /* Packet actions: */
 #define DSR_PKT_NONE           1
@@ -116,7 +125,13 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb);
 #endif
 char *dsr_pkt_alloc_opts(struct dsr_pkt *dp, int len);
 char *dsr_pkt_alloc_opts_expand(struct dsr_pkt *dp, int len);
+int dsr_pkt_opts_cow(struct dsr_pkt *dp);
 void dsr_pkt_free(struct dsr_pkt *dp);
 int dsr_pkt_free_opts(struct dsr_pkt *dp);
+void dsr_opts_buf_free(char *buf, int size);
+#ifdef __KERNEL__
+int dsr_pkt_cache_init(void);
+void dsr_pkt_cache_cleanup(void);
+#endif
 
 #endif				/* _DSR_PKT_H */
@@ -28,6 +28,7 @@
 #include "link-cache.h"
 #include "send-buf.h"
 #include "timer.h"
+#include "timer-wheel.h"
 
 #define GRAT_RREP_TBL_MAX_LEN 64
 #define GRAT_REPLY_HOLDOFF 1
@@ -35,7 +36,7 @@
 #ifdef __KERNEL__
 #define GRAT_RREP_TBL_PROC_NAME "dsr_grat_rrep_tbl"
 static TBL(grat_rrep_tbl, GRAT_RREP_TBL_MAX_LEN);
-DSRUUTimer grat_rrep_tbl_timer;
+static struct tw_timer grat_rrep_tbl_timer;
 #endif
 
 struct grat_rrep_entry {
@@ -83,9 +84,7 @@ void NSCLASS grat_rrep_tbl_timeout(unsigned long data)
 
 	e = (struct grat_rrep_entry *)TBL_FIRST(&grat_rrep_tbl);
 
-	grat_rrep_tbl_timer.function = &NSCLASS grat_rrep_tbl_timeout;
-
-	set_timer(&grat_rrep_tbl_timer, &e->expires);
+	tw_timer_set(&grat_rrep_tbl_timer, &e->expires);
 
 	read_unlock_bh(&grat_rrep_tbl.lock);
 }
@@ -110,17 +109,12 @@ int NSCLASS grat_rrep_tbl_add(struct in_addr src, struct in_addr prev_hop)
 
 	timeval_add_usecs(&e->expires, ConfValToUsecs(GratReplyHoldOff));
 
-	/* Remove timer before we modify the table */
-	if (timer_pending(&grat_rrep_tbl_timer))
-		del_timer_sync(&grat_rrep_tbl_timer);
-
 	if (tbl_add(&grat_rrep_tbl, &e->l, crit_time)) {
 
 		read_lock_bh(&grat_rrep_tbl.lock);
 		e = (struct grat_rrep_entry *)TBL_FIRST(&grat_rrep_tbl);
 
-		grat_rrep_tbl_timer.function = &NSCLASS grat_rrep_tbl_timeout;
-		set_timer(&grat_rrep_tbl_timer, &e->expires);
+		tw_timer_set(&grat_rrep_tbl_timer, &e->expires);
 		read_unlock_bh(&grat_rrep_tbl.lock);
 	}
 	return 1;
@@ -391,7 +385,9 @@ int NSCLASS dsr_rrep_opt_recv(struct dsr_pkt *dp, struct dsr_rrep_opt *rrep_opt)
 /* 	} */
 /*  end_add_srt: */
 	/* Remove pending RREQs */
-	rreq_tbl_route_discovery_cancel(rrep_opt_srt->dst);
+	rreq_tbl_route_discovery_cancel(rrep_opt_srt->dst,
+					rrep_opt_srt->laddrs /
+					sizeof(struct in_addr) + 1);
 
 	kfree(rrep_opt_srt);
 
@@ -423,16 +419,16 @@ int __init NSCLASS grat_rrep_tbl_init(void)
 #endif
 	INIT_TBL(&grat_rrep_tbl, GRAT_RREP_TBL_MAX_LEN);
 
-	init_timer(&grat_rrep_tbl_timer);
+	tw_timer_init(&grat_rrep_tbl_timer, &NSCLASS grat_rrep_tbl_timeout, 0);
 
 	return 0;
 }
 
-void __exit NSCLASS grat_rrep_tbl_cleanup(void)
+void NSCLASS grat_rrep_tbl_cleanup(void)
 {
-	tbl_flush(&grat_rrep_tbl, NULL);
+	tw_timer_del_sync(&grat_rrep_tbl_timer);
 
-	del_timer_sync(&grat_rrep_tbl_timer);
+	tbl_flush(&grat_rrep_tbl, NULL);
 
 #ifdef __KERNEL__
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
@@ -16,6 +16,7 @@
 #endif
 
 #ifdef NS2
+#include <tools/random.h>
 #include "ns-agent.h"
 #endif
 
@@ -28,13 +29,19 @@
 #include "link-cache.h"
 #include "send-buf.h"
 #include "neigh.h"
+#include "timer-wheel.h"
 
 #ifndef NS2
 
 #define RREQ_TBL_PROC_NAME "dsr_rreq_tbl"
 
 static TBL(rreq_tbl, RREQ_TBL_MAX_LEN);
+static TBL(rreq_fwd_q, RREQ_FWD_Q_MAX_LEN);
+static list_t rreq_hash[RREQ_TBL_HASH_SIZE];
 static unsigned int rreq_seqno;
+static struct rreq_tbl_stats rreq_stats;
+static struct rreq_bucket rreq_bucket;
+static struct tw_timer rreq_coalesce_timer;
 #endif
 
 #ifndef MAXTTL
@@ -43,59 +50,183 @@ static unsigned int rreq_seqno;
 
 #define STATE_IDLE          0
 #define STATE_IN_ROUTE_DISC 1
+#define STATE_HOLDOFF       2	/* Destination unreachable, no discovery */
+
+/* A recently seen RREQ of an initiator */
+struct rreq_id {
+	struct in_addr trg_addr;
+	unsigned short id;
+};
 
 struct rreq_tbl_entry {
 	list_t l;
+	list_t hl;		/* Hash chain */
 	int state;
 	struct in_addr node_addr;
 	int ttl;
 	atomic_t refcnt;
-	DSRUUTimer *timer;
-	struct timeval tx_time;
+	struct tw_timer timer;
+	struct timeval tx_time;	/* Start of the current discovery */
+	int last_hops;		/* Last known hop count to the node */
+	int seeded;		/* Discovery started from last_hops */
+	int deferred;		/* Next RREQ was held back by the limiter */
+	int coalesce;		/* First RREQ waits to be coalesced */
+	struct rreq_bucket bucket;
 	struct timeval last_used;
 	usecs_t timeout;
 	unsigned int num_rexmts;
-	struct tbl rreq_id_tbl;
+	usecs_t holdoff;
+	struct timeval holdoff_exp;
+	/* Ring of the most recent RREQ IDs, the oldest is overwritten */
+	struct rreq_id ids[RREQ_TLB_MAX_ID];
+	unsigned int num_ids, max_ids, next_id;
 };
 
-struct id_entry {
+/* A RREQ held back for a random time before it is rebroadcast. Duplicates
+ * of it that are received in the meantime are counted, and the rebroadcast
+ * is cancelled if enough neighbors have already forwarded the RREQ. */
+struct rreq_fwd_entry {
 	list_t l;
-	atomic_t refcnt;
-	struct in_addr trg_addr;
+	struct in_addr initiator;
+	struct in_addr target;
 	unsigned short id;
+	unsigned int dups;
+	struct dsr_pkt *dp;
+	struct tw_timer timer;
 };
-struct rreq_tbl_query {
-	struct in_addr *initiator;
-	struct in_addr *target;
-	unsigned int *id;
+
+/* Upper bounds (ms) of the discovery latency buckets. The last bucket
+ * holds everything above. */
+static const unsigned int rreq_latency_ms[RREQ_LATENCY_BUCKETS - 1] = {
+	10, 25, 50, 100, 250, 500, 1000
 };
 
-static inline int crit_addr(void *pos, void *data)
+/* The TTL that covers the whole network */
+static inline int rreq_max_ttl(void)
 {
-	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
-	struct in_addr *a = (struct in_addr *)data;
+	int diameter = ConfVal(NetworkDiameter);
+
+	if (diameter <= 0 || diameter > MAXTTL)
+		return MAXTTL;
+	return diameter;
+}
+
+static inline unsigned long rreq_fwd_random(unsigned long range)
+{
+#ifdef NS2
+	return (unsigned long)(Random::uniform() * range);
+#else
+	return net_random() % range;
+#endif
+}
+
+/* Returns the time in usecs until the bucket has a token, or 0 if it has one
+ * now. An interval of 0 means no limit. */
+static long rreq_bucket_wait(struct rreq_bucket *b, usecs_t interval,
+			     unsigned int burst, struct timeval *now)
+{
+	long max;
+
+	if (interval == 0)
+		return 0;
+
+	max = interval * (burst ? burst : 1);
+
+	if (b->credit < 0)
+		b->credit = max;
+	else {
+		long secs = now->tv_sec - b->last.tv_sec;
+		long elapsed = 0;
+
+		/* The time in usecs since the bucket was last used overflows
+		 * on 32-bit after about 35 minutes, so it is only computed
+		 * when the bucket may not yet be full */
+		if (secs >= 0 && secs <= max / 1000000)
+			elapsed = timeval_diff(now, &b->last);
+
+		if (secs < 0 || secs > max / 1000000 || elapsed < 0 ||
+		    elapsed >= max - b->credit)
+			b->credit = max;
+		else
+			b->credit += elapsed;
+	}
+
+	b->last = *now;
+
+	if (b->credit >= (long)interval)
+		return 0;
+
+	return interval - b->credit;
+}
+
+/* Check the global and per target budgets before a RREQ is sent. Returns 0
+ * and takes a token from both if the RREQ may go, otherwise the time in
+ * usecs to wait. The RREQ table must be locked. */
+long NSCLASS __rreq_rate_limit(struct rreq_tbl_entry *e, struct timeval *now)
+{
+	usecs_t g_interval = 0, t_interval = ConfValToUsecs(TargetRequestInterval);
+	long g_wait, t_wait;
+
+	if (ConfVal(RequestRateLimit))
+		g_interval = 1000000 / ConfVal(RequestRateLimit);
+
+	g_wait = rreq_bucket_wait(&rreq_bucket, g_interval,
+				  ConfVal(RequestRateBurst), now);
+	t_wait = rreq_bucket_wait(&e->bucket, t_interval,
+				  ConfVal(TargetRequestBurst), now);
+
+	if (t_wait) {
+		rreq_stats.target_limited++;
+		return t_wait > g_wait ? t_wait : g_wait;
+	}
+	if (g_wait) {
+		rreq_stats.rate_limited++;
+		return g_wait;
+	}
+
+	if (g_interval)
+		rreq_bucket.credit -= g_interval;
+	if (t_interval)
+		e->bucket.credit -= t_interval;
 
-	if (e->node_addr.s_addr == a->s_addr)
-		return 1;
 	return 0;
 }
 
-static inline int crit_duplicate(void *pos, void *data)
+static inline unsigned int rreq_hash_idx(struct in_addr addr)
 {
-	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
-	struct rreq_tbl_query *q = (struct rreq_tbl_query *)data;
+	unsigned int h = ntohl(addr.s_addr);
 
-	if (e->node_addr.s_addr == q->initiator->s_addr) {
-		list_t *p;
+	h ^= (h >> 16);
+	h ^= (h >> 8);
 
-		list_for_each(p, &e->rreq_id_tbl.head) {
-			struct id_entry *id_e = (struct id_entry *)p;
+	return h & (RREQ_TBL_HASH_SIZE - 1);
+}
 
-			if (id_e->trg_addr.s_addr == q->target->s_addr &&
-			    id_e->id == *(q->id))
-				return 1;
-		}
+/* Find the entry of a node. The table must be locked. */
+static struct rreq_tbl_entry *__rreq_tbl_find(list_t *hash,
+					      struct in_addr addr)
+{
+	list_t *pos;
+
+	list_for_each(pos, &hash[rreq_hash_idx(addr)]) {
+		struct rreq_tbl_entry *e =
+		    list_entry(pos, struct rreq_tbl_entry, hl);
+
+		if (e->node_addr.s_addr == addr.s_addr)
+			return e;
 	}
+	return NULL;
+}
+
+static inline int rreq_id_seen(struct rreq_tbl_entry *e,
+			       struct in_addr target, unsigned short id)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->num_ids; i++)
+		if (e->ids[i].id == id &&
+		    e->ids[i].trg_addr.s_addr == target.s_addr)
+			return 1;
 	return 0;
 }
 
@@ -103,12 +234,58 @@ void NSCLASS rreq_tbl_set_max_len(unsigned int max_len)
 {
 	rreq_tbl.max_len = max_len;
 }
+
+int NSCLASS rreq_tbl_stats_print(char *buf)
+{
+	int i, len = 0;
+
+	len += sprintf(buf + len,
+		       "\nUnreachable holdoffs   : %u\n"
+		       "Suppressed discoveries : %u\n"
+		       "Cleared holdoffs       : %u\n",
+		       rreq_stats.holdoffs, rreq_stats.suppressed,
+		       rreq_stats.cleared);
+
+	len += sprintf(buf + len,
+		       "Route discoveries      : %u\n"
+		       "RREQs per discovery    : %u.%02u\n"
+		       "Forwarded RREQs        : %u\n"
+		       "Suppressed rebroadcasts: %u\n"
+		       "Rate limited RREQs     : %u\n"
+		       "Budget limited RREQs   : %u\n"
+		       "Coalesced targets      : %u\n",
+		       rreq_stats.discoveries,
+		       rreq_stats.discoveries ?
+		       rreq_stats.sent / rreq_stats.discoveries : 0,
+		       rreq_stats.discoveries ?
+		       (rreq_stats.sent * 100 / rreq_stats.discoveries) % 100 :
+		       0, rreq_stats.forwarded, rreq_stats.fwd_dropped,
+		       rreq_stats.rate_limited, rreq_stats.target_limited,
+		       rreq_stats.coalesced);
+
+	len += sprintf(buf + len, "\n# %-12s %-10s %-10s\n",
+		       "Latency(ms)", "Unseeded", "Seeded");
+
+	for (i = 0; i < RREQ_LATENCY_BUCKETS; i++) {
+		char bucket[16];
+
+		if (i < RREQ_LATENCY_BUCKETS - 1)
+			sprintf(bucket, "<=%u", rreq_latency_ms[i]);
+		else
+			sprintf(bucket, ">%u", rreq_latency_ms[i - 1]);
+
+		len += sprintf(buf + len, "  %-12s %-10u %-10u\n", bucket,
+			       rreq_stats.latency[0][i],
+			       rreq_stats.latency[1][i]);
+	}
+	return len;
+}
+
 #ifdef __KERNEL__
 static int rreq_tbl_print(struct tbl *t, char *buf)
 {
-	list_t *pos1, *pos2;
+	list_t *pos;
 	int len = 0;
-	int first = 1;
 	struct timeval now;
 
 	gettime(&now);
@@ -116,37 +293,51 @@ static int rreq_tbl_print(struct tbl *t, char *buf)
 	read_lock_bh(&t->lock);
 	
 	len +=
-	    sprintf(buf, "# %-15s %-6s %-8s %15s:%s\n", "IPAddr", "TTL", "Used",
-		    "TargetIPAddr", "ID");
-
-	list_for_each(pos1, &t->head) {
-		struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos1;
-		struct id_entry *id_e;
-
-		if (TBL_EMPTY(&e->rreq_id_tbl))
+	    sprintf(buf, "# %-15s %-6s %-8s %-8s %15s:%s\n", "IPAddr", "TTL",
+		    "Used", "Holdoff", "TargetIPAddr", "ID");
+
+	list_for_each(pos, &t->head) {
+		struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
+		struct rreq_id *id_e;
+		unsigned int i, oldest;
+		char holdoff[12];
+
+		if (e->state == STATE_HOLDOFF &&
+		    timeval_diff(&e->holdoff_exp, &now) > 0)
+			sprintf(holdoff, "%ld",
+				timeval_diff(&e->holdoff_exp, &now) / 1000000);
+		else
+			sprintf(holdoff, "-");
+
+		/* Print the IDs from the oldest one */
+		oldest = e->num_ids < e->max_ids ? 0 : e->next_id;
+
+		if (e->num_ids == 0)
 			len +=
-			    sprintf(buf + len, "  %-15s %-6u %-8lu %15s:%s\n",
+			    sprintf(buf + len,
+				    "  %-15s %-6u %-8lu %-8s %15s:%s\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
-				    "-", "-");
+				    holdoff, "-", "-");
 		else {
-			id_e = (struct id_entry *)TBL_FIRST(&e->rreq_id_tbl);
+			id_e = &e->ids[oldest];
 			len +=
-			    sprintf(buf + len, "  %-15s %-6u %-8lu %15s:%u\n",
+			    sprintf(buf + len,
+				    "  %-15s %-6u %-8lu %-8s %15s:%u\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
-				    print_ip(id_e->trg_addr), id_e->id);
+				    holdoff, print_ip(id_e->trg_addr), id_e->id);
 		}
-		list_for_each(pos2, &e->rreq_id_tbl.head) {
-			id_e = (struct id_entry *)pos2;
-			if (!first)
-				len +=
-				    sprintf(buf + len, "%49s:%u\n",
-					    print_ip(id_e->trg_addr), id_e->id);
-			first = 0;
+		for (i = 1; i < e->num_ids; i++) {
+			id_e = &e->ids[(oldest + i) % e->max_ids];
+			len +=
+			    sprintf(buf + len, "%58s:%u\n",
+				    print_ip(id_e->trg_addr), id_e->id);
 		}
 	}
 
+	len += rreq_tbl_stats_print(buf + len);
+
 	read_unlock_bh(&t->lock);
 	return len;
 
@@ -156,22 +347,60 @@ static int rreq_tbl_print(struct tbl *t, char *buf)
 void NSCLASS rreq_tbl_timeout(unsigned long data)
 {
 	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)data;
+	struct in_addr dst;
 	struct timeval expires;
+	long wait;
+	int ttl = 0;
 
 	if (!e)
 		return;
 
-	tbl_detach(&rreq_tbl, &e->l);
+	/* The entry stays in the table, where it can be found through the
+	 * hash, so it is only changed with the table locked */
+	write_lock_bh(&rreq_tbl.lock);
+
+	/* The timer can fire just as the discovery is cancelled */
+	if (e->state != STATE_IN_ROUTE_DISC) {
+		write_unlock_bh(&rreq_tbl.lock);
+		return;
+	}
+
+	dst = e->node_addr;
 
 	LOG_DBG("RREQ Timeout dst=%s timeout=%lu rexmts=%d \n",
-                print_ip(e->node_addr), e->timeout, e->num_rexmts);
-        
+                print_ip(dst), e->timeout, e->num_rexmts);
+
+	/* A RREQ held back by the limiter is sent as it is */
+	if (e->deferred)
+		goto send;
+
 	if (e->num_rexmts >= ConfVal(MaxRequestRexmt)) {
-		LOG_DBG("MAX RREQs reached for %s\n", print_ip(e->node_addr));
+		/* Give up on the destination for a while. The holdoff is
+		 * doubled each time discovery fails again, until a RREP or
+		 * RREQ shows that the node is reachable. */
+		if (e->holdoff == 0)
+			e->holdoff = ConfValToUsecs(UnreachableHoldoff);
+		else
+			e->holdoff *= 2;
 
-		e->state = STATE_IDLE;
+		if (e->holdoff > ConfValToUsecs(MaxUnreachableHoldoff))
+			e->holdoff = ConfValToUsecs(MaxUnreachableHoldoff);
 
-		tbl_add_tail(&rreq_tbl, &e->l);
+		LOG_DBG("MAX RREQs reached for %s, holdoff %lu s\n",
+			print_ip(dst), e->holdoff / 1000000);
+
+		e->state = STATE_HOLDOFF;
+		e->last_hops = 0;
+		gettime(&e->holdoff_exp);
+		timeval_add_usecs(&e->holdoff_exp, e->holdoff);
+
+		rreq_stats.holdoffs++;
+		list_move_tail(&e->l, &rreq_tbl.head);
+
+		write_unlock_bh(&rreq_tbl.lock);
+
+		/* Don't keep packets that will never get a route */
+		send_buf_set_verdict(SEND_BUF_DROP, dst);
 		return;
 	}
 
@@ -184,23 +413,38 @@ void NSCLASS rreq_tbl_timeout(unsigned long data)
 
 	e->ttl *= 2;		/* Double TTL */
 
-	if (e->ttl > MAXTTL)
-		e->ttl = MAXTTL;
+	if (e->ttl > rreq_max_ttl())
+		e->ttl = rreq_max_ttl();
 
 	if (e->timeout > ConfValToUsecs(MaxRequestPeriod))
 		e->timeout = ConfValToUsecs(MaxRequestPeriod);
-
+      send:
 	gettime(&e->last_used);
 
-	dsr_rreq_send(e->node_addr, e->ttl);
+	wait = __rreq_rate_limit(e, &e->last_used);
 
 	expires = e->last_used;
-	timeval_add_usecs(&expires, e->timeout);
+
+	if (wait) {
+		/* The buffered packets wait until a token is due */
+		LOG_DBG("RREQ for %s rate limited\n", print_ip(dst));
+		e->deferred = 1;
+		timeval_add_usecs(&expires, wait);
+	} else {
+		e->deferred = 0;
+		ttl = e->ttl;
+		timeval_add_usecs(&expires, e->timeout);
+	}
 
 	/* Put at end of list */
-	tbl_add_tail(&rreq_tbl, &e->l);
+	list_move_tail(&e->l, &rreq_tbl.head);
+
+	tw_timer_set(&e->timer, &expires);
 
-	set_timer(e->timer, &expires);
+	write_unlock_bh(&rreq_tbl.lock);
+
+	if (ttl)
+		dsr_rreq_send(dst, ttl);
 }
 
 struct rreq_tbl_entry *NSCLASS __rreq_tbl_entry_create(struct in_addr node_addr)
@@ -217,25 +461,25 @@ struct rreq_tbl_entry *NSCLASS __rreq_tbl_entry_create(struct in_addr node_addr)
 	e->node_addr = node_addr;
 	e->ttl = 0;
 	atomic_set(&e->refcnt, 1);
-	memset(&e->tx_time, 0, sizeof(struct timeval));;
+	memset(&e->tx_time, 0, sizeof(struct timeval));
+	e->last_hops = 0;
+	e->seeded = 0;
+	e->deferred = 0;
+	e->coalesce = 0;
+	e->bucket.credit = -1;
 	e->num_rexmts = 0;
-#ifdef NS2
-	e->timer = new DSRUUTimer(this, "RREQTblTimer");
-#else
-	e->timer = kmalloc(sizeof(DSRUUTimer), GFP_ATOMIC);
-#endif
-
-	if (!e->timer) {
-		kfree(e);
-		return NULL;
-	}
+	e->holdoff = 0;
+	memset(&e->holdoff_exp, 0, sizeof(struct timeval));
+	tw_timer_init(&e->timer, &NSCLASS rreq_tbl_timeout, (unsigned long)e);
 
-	init_timer(e->timer);
+	e->num_ids = 0;
+	e->next_id = 0;
+	e->max_ids = ConfVal(RequestTableIds);
 
-	e->timer->function = &NSCLASS rreq_tbl_timeout;
-	e->timer->data = (unsigned long)e;
-
-	INIT_TBL(&e->rreq_id_tbl, ConfVal(RequestTableIds));
+	if (e->max_ids > RREQ_TLB_MAX_ID)
+		e->max_ids = RREQ_TLB_MAX_ID;
+	else if (e->max_ids == 0)
+		e->max_ids = 1;
 
 	return e;
 }
@@ -250,39 +494,45 @@ struct rreq_tbl_entry *NSCLASS __rreq_tbl_add(struct in_addr node_addr)
 		return NULL;
 
 	if (TBL_FULL(&rreq_tbl)) {
-		struct rreq_tbl_entry *f;
+		struct rreq_tbl_entry *f = NULL;
+		list_t *pos;
+
+		/* Evict the least recently used entry. The timer of an
+		 * ongoing discovery may be running, so such an entry is never
+		 * evicted. */
+		list_for_each(pos, &rreq_tbl.head) {
+			f = (struct rreq_tbl_entry *)pos;
+
+			if (f->state != STATE_IN_ROUTE_DISC)
+				break;
+			f = NULL;
+		}
 
-		f = (struct rreq_tbl_entry *)TBL_FIRST(&rreq_tbl);
+		if (!f) {
+			kfree(e);
+			return NULL;
+		}
 
 		__tbl_detach(&rreq_tbl, &f->l);
-
-		del_timer_sync(f->timer);
-#ifdef NS2
-		delete f->timer;
-#else
-		kfree(f->timer);
-#endif
-		tbl_flush(&f->rreq_id_tbl, NULL);
-
+		list_del(&f->hl);
 		kfree(f);
 	}
 	__tbl_add_tail(&rreq_tbl, &e->l);
+	list_add(&e->hl, &rreq_hash[rreq_hash_idx(node_addr)]);
 
 	return e;
 }
 
 int NSCLASS
 rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
-		unsigned short id)
+		unsigned short id, int hops)
 {
 	struct rreq_tbl_entry *e;
-	struct id_entry *id_e;
 	int res = 0;
 
 	write_lock_bh(&rreq_tbl.lock);
 
-	e = (struct rreq_tbl_entry *)__tbl_find(&rreq_tbl, &initiator,
-						crit_addr);
+	e = __rreq_tbl_find(rreq_hash, initiator);
 
 	if (!e)
 		e = __rreq_tbl_add(initiator);
@@ -299,45 +549,73 @@ rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
 
 	gettime(&e->last_used);
 
-	if (TBL_FULL(&e->rreq_id_tbl))
-		tbl_del_first(&e->rreq_id_tbl);
-
-	id_e = (struct id_entry *)kmalloc(sizeof(struct id_entry), GFP_ATOMIC);
-
-	if (!id_e) {
-		res = -ENOMEM;
-		goto out;
+	/* A RREQ from the node proves that it is reachable again */
+	if (e->state == STATE_HOLDOFF) {
+		e->state = STATE_IDLE;
+		rreq_stats.cleared++;
 	}
+	e->holdoff = 0;
+	e->last_hops = hops;
+
+	e->ids[e->next_id].trg_addr = target;
+	e->ids[e->next_id].id = id;
 
-	id_e->trg_addr = target;
-	id_e->id = id;
+	e->next_id = (e->next_id + 1) % e->max_ids;
 
-	tbl_add_tail(&e->rreq_id_tbl, &id_e->l);
+	if (e->num_ids < e->max_ids)
+		e->num_ids++;
       out:
 	write_unlock_bh(&rreq_tbl.lock);
 
+	if (res < 0)
+		return res;
+
 	return 1;
 }
 
-int NSCLASS rreq_tbl_route_discovery_cancel(struct in_addr dst)
+int NSCLASS rreq_tbl_route_discovery_cancel(struct in_addr dst, int hops)
 {
 	struct rreq_tbl_entry *e;
+	struct timeval now;
+
+	write_lock_bh(&rreq_tbl.lock);
 
-	e = (struct rreq_tbl_entry *)tbl_find_detach(&rreq_tbl, &dst,
-						     crit_addr);
+	e = __rreq_tbl_find(rreq_hash, dst);
 
 	if (!e) {
+		write_unlock_bh(&rreq_tbl.lock);
 		LOG_DBG("%s not in RREQ table\n", print_ip(dst));
 		return -1;
 	}
 
-	if (e->state == STATE_IN_ROUTE_DISC)
-		del_timer_sync(e->timer);
+	gettime(&now);
+
+	if (e->state == STATE_IN_ROUTE_DISC) {
+		unsigned long ms = timeval_diff(&now, &e->tx_time) / 1000;
+		int i;
+
+		tw_timer_del(&e->timer);
+
+		for (i = 0; i < RREQ_LATENCY_BUCKETS - 1; i++)
+			if (ms <= rreq_latency_ms[i])
+				break;
+
+		rreq_stats.latency[e->seeded][i]++;
+	}
+
+	__tbl_detach(&rreq_tbl, &e->l);
+
+	if (e->state == STATE_HOLDOFF)
+		rreq_stats.cleared++;
 
 	e->state = STATE_IDLE;
-	gettime(&e->last_used);
+	e->holdoff = 0;
+	e->last_hops = hops;
+	e->last_used = now;
 
-	tbl_add_tail(&rreq_tbl, &e->l);
+	__tbl_add_tail(&rreq_tbl, &e->l);
+
+	write_unlock_bh(&rreq_tbl.lock);
 
 	return 1;
 }
@@ -346,13 +624,12 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 {
 	struct rreq_tbl_entry *e;
 	int ttl, res = 0;
+	long wait;
 	struct timeval expires;
 
-#define	TTL_START 1
-
 	write_lock_bh(&rreq_tbl.lock);
 
-	e = (struct rreq_tbl_entry *)__tbl_find(&rreq_tbl, &target, crit_addr);
+	e = __rreq_tbl_find(rreq_hash, target);
 
 	if (!e)
 		e = __rreq_tbl_add(target);
@@ -372,29 +649,82 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
                         print_ip(target));
 		goto out;
 	}
-	LOG_DBG("Route discovery for %s\n", print_ip(target));
 
 	gettime(&e->last_used);
-	e->ttl = ttl = TTL_START;
+
+	if (e->state == STATE_HOLDOFF) {
+		if (timeval_diff(&e->holdoff_exp, &e->last_used) > 0) {
+			LOG_DBG("Route discovery for %s in holdoff\n",
+				print_ip(target));
+			rreq_stats.suppressed++;
+			goto out;
+		}
+		e->state = STATE_IDLE;
+	}
+	LOG_DBG("Route discovery for %s\n", print_ip(target));
+
+	/* Start the expanding ring search at the hop count that the node had
+	 * the last time it was heard of, plus one hop of slack in case it
+	 * moved away. Otherwise, start with a non-propagating RREQ. */
+	if (ConfVal(SeedRequestTTL) && e->last_hops > 0) {
+		ttl = e->last_hops + 1;
+
+		if (ttl > rreq_max_ttl())
+			ttl = rreq_max_ttl();
+		e->seeded = 1;
+	} else {
+		ttl = 1;
+		e->seeded = 0;
+	}
+	e->ttl = ttl;
+
 	/* The draft does not actually specify how these Request Timeout values
-	 * should be used... ??? I am just guessing here. */
+	 * should be used... ??? I am just guessing here. The timeout of a
+	 * seeded RREQ grows with the TTL, like that of the doubled ones. */
+	e->timeout = ConfValToUsecs(NonpropRequestTimeout) * ttl;
 
-	if (e->ttl == 1)
-		e->timeout = ConfValToUsecs(NonpropRequestTimeout);
-	else
+	if (ttl > 1 && e->timeout > ConfValToUsecs(RequestPeriod))
 		e->timeout = ConfValToUsecs(RequestPeriod);
 
+	e->tx_time = e->last_used;
+	rreq_stats.discoveries++;
+
 	e->state = STATE_IN_ROUTE_DISC;
 	e->num_rexmts = 0;
 
+	wait = __rreq_rate_limit(e, &e->last_used);
+
 	expires = e->last_used;
-	timeval_add_usecs(&expires, e->timeout);
 
-	set_timer(e->timer, &expires);
+	if (wait) {
+		/* The packets wait in the send buffer until a token is due */
+		LOG_DBG("RREQ for %s rate limited\n", print_ip(target));
+		e->deferred = 1;
+		timeval_add_usecs(&expires, wait);
+	} else if (ConfVal(RequestCoalesceDelay)) {
+		/* Wait for other discoveries to start, so that they can all
+		 * be sent in one multi-target RREQ */
+		e->deferred = 0;
+		e->coalesce = 1;
+		timeval_add_usecs(&expires, ConfValToUsecs(RequestCoalesceDelay) +
+				  e->timeout);
+	} else {
+		e->deferred = 0;
+		timeval_add_usecs(&expires, e->timeout);
+	}
+
+	tw_timer_set(&e->timer, &expires);
 
+	if (e->coalesce && !tw_timer_pending(&rreq_coalesce_timer)) {
+		expires = e->last_used;
+		timeval_add_usecs(&expires,
+				  ConfValToUsecs(RequestCoalesceDelay));
+		tw_timer_set(&rreq_coalesce_timer, &expires);
+	}
 	write_unlock_bh(&rreq_tbl.lock);
 
-	dsr_rreq_send(target, ttl);
+	if (!wait && !e->coalesce)
+		dsr_rreq_send(target, ttl);
 
 	return 1;
       out:
@@ -403,20 +733,51 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 	return res;
 }
 
+/* Check whether a destination is in the negative route cache, i.e., route
+ * discovery recently failed. Returns 1 if packets to the destination should
+ * be dropped without starting a new discovery. */
+int NSCLASS dsr_rreq_holdoff(struct in_addr target)
+{
+	struct rreq_tbl_entry *e;
+	struct timeval now;
+	int res = 0;
+
+	write_lock_bh(&rreq_tbl.lock);
+
+	e = __rreq_tbl_find(rreq_hash, target);
+
+	if (!e || e->state != STATE_HOLDOFF)
+		goto out;
+
+	gettime(&now);
+
+	if (timeval_diff(&e->holdoff_exp, &now) > 0) {
+		rreq_stats.suppressed++;
+		res = 1;
+	} else
+		e->state = STATE_IDLE;
+      out:
+	write_unlock_bh(&rreq_tbl.lock);
+
+	return res;
+}
+
 int NSCLASS dsr_rreq_duplicate(struct in_addr initiator, struct in_addr target,
 			       unsigned int id)
 {
-	struct {
-		struct in_addr *initiator;
-		struct in_addr *target;
-		unsigned int *id;
-	} d;
+	struct rreq_tbl_entry *e;
+	int res = 0;
 
-	d.initiator = &initiator;
-	d.target = &target;
-	d.id = &id;
+	read_lock_bh(&rreq_tbl.lock);
 
-	return in_tbl(&rreq_tbl, &d, crit_duplicate);
+	e = __rreq_tbl_find(rreq_hash, initiator);
+
+	if (e)
+		res = rreq_id_seen(e, target, id);
+
+	read_unlock_bh(&rreq_tbl.lock);
+
+	return res;
 }
 
 static struct dsr_rreq_opt *dsr_rreq_opt_add(char *buf, unsigned int len,
@@ -438,11 +799,63 @@ static struct dsr_rreq_opt *dsr_rreq_opt_add(char *buf, unsigned int len,
 	return rreq_opt;
 }
 
+/* Send the first RREQs of the discoveries that waited to be coalesced. Up
+ * to DSR_RREQ_MAX_TRG targets go in each RREQ, which is sent with the
+ * largest TTL among them. */
+void NSCLASS rreq_coalesce_timeout(unsigned long data)
+{
+	struct in_addr targets[DSR_RREQ_MAX_TRG];
+	list_t *pos;
+	int n, ttl;
+
+	do {
+		n = ttl = 0;
+
+		write_lock_bh(&rreq_tbl.lock);
+
+		list_for_each(pos, &rreq_tbl.head) {
+			struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
+
+			if (!e->coalesce)
+				continue;
+
+			e->coalesce = 0;
+
+			if (e->state != STATE_IN_ROUTE_DISC)
+				continue;
+
+			targets[n++] = e->node_addr;
+
+			if (e->ttl > ttl)
+				ttl = e->ttl;
+
+			if (n == DSR_RREQ_MAX_TRG)
+				break;
+		}
+		if (n > 1)
+			rreq_stats.coalesced += n - 1;
+
+		write_unlock_bh(&rreq_tbl.lock);
+
+		if (n)
+			dsr_rreq_send_multi(targets, n, ttl);
+
+	} while (n == DSR_RREQ_MAX_TRG);
+}
+
 int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
+{
+	return dsr_rreq_send_multi(&target, 1, ttl);
+}
+
+int NSCLASS dsr_rreq_send_multi(struct in_addr *targets, int n, int ttl)
 {
 	struct dsr_pkt *dp;
 	char *buf;
-	int len = DSR_OPT_HDR_LEN + DSR_RREQ_HDR_LEN;
+	int i, len = DSR_OPT_HDR_LEN + DSR_RREQ_HDR_LEN;
+
+	if (n > 1)
+		len += DSR_RREQ_TRG_HDR_LEN + (n - 1) * sizeof(u_int32_t);
 
 	dp = dsr_pkt_alloc(NULL);
 
@@ -476,20 +889,35 @@ int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
 	buf += DSR_OPT_HDR_LEN;
 	len -= DSR_OPT_HDR_LEN;
 
-	dp->rreq_opt = dsr_rreq_opt_add(buf, len, target, ++rreq_seqno);
+	if (n > 1) {
+		dp->rreq_trg_opt = (struct dsr_rreq_trg_opt *)buf;
+		dp->rreq_trg_opt->type = DSR_OPT_RREQ_TRG;
+		dp->rreq_trg_opt->length = (n - 1) * sizeof(u_int32_t);
+
+		for (i = 1; i < n; i++)
+			dp->rreq_trg_opt->targets[i - 1] = targets[i].s_addr;
+
+		buf += DSR_RREQ_TRG_HDR_LEN + dp->rreq_trg_opt->length;
+		len -= DSR_RREQ_TRG_HDR_LEN + dp->rreq_trg_opt->length;
+	}
+
+	dp->rreq_opt = dsr_rreq_opt_add(buf, len, targets[0], ++rreq_seqno);
 
 	if (!dp->rreq_opt) {
 		LOG_DBG("Could not create RREQ opt\n");
 		goto out_err;
 	}
 #ifdef NS2
-	LOG_DBG("Sending RREQ src=%s dst=%s target=%s ttl=%d iph->saddr()=%d\n",
-                print_ip(dp->src), print_ip(dp->dst), print_ip(target), ttl,
+	LOG_DBG("Sending RREQ src=%s dst=%s target=%s (+%d) ttl=%d iph->saddr()=%d\n",
+                print_ip(dp->src), print_ip(dp->dst), print_ip(targets[0]),
+                n - 1, ttl,
                 dp->nh.iph->saddr());
 #endif
 
 	dp->flags |= PKT_XMIT_JITTER;
 
+	rreq_stats.sent++;
+
 	XMIT(dp);
 
 	return 0;
@@ -500,13 +928,59 @@ int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
 	return -1;
 }
 
+/* Reply on behalf of the additional targets of a multi-target RREQ that
+ * this node is, or has a cached route to. Returns the number of targets
+ * left unanswered. */
+int NSCLASS dsr_rreq_trg_reply(struct dsr_pkt *dp, struct dsr_srt *srt_rev)
+{
+	struct in_addr myaddr = my_addr();
+	int i, pending = 0;
+
+	for (i = 0; i < (int)DSR_RREQ_TRG_NUM(dp->rreq_trg_opt); i++) {
+		struct dsr_srt *srt_rc, *srt_cat;
+		struct in_addr trg;
+
+		trg.s_addr = dp->rreq_trg_opt->targets[i];
+
+		if (trg.s_addr == myaddr.s_addr) {
+			LOG_DBG("Multi-target RREQ for me - Send RREP\n");
+			dsr_rrep_send(srt_rev, dp->srt);
+			continue;
+		}
+
+		if (!lc_srt_exists(myaddr, trg) ||
+		    !(srt_rc = lc_srt_find(myaddr, trg))) {
+			pending++;
+			continue;
+		}
+
+		srt_cat = dsr_srt_concatenate(dp->srt, srt_rc);
+
+		kfree(srt_rc);
+
+		if (!srt_cat || dsr_srt_check_duplicate(srt_cat) > 0) {
+			if (srt_cat)
+				kfree(srt_cat);
+			pending++;
+			continue;
+		}
+		LOG_DBG("Sending cached RREP for %s to %s\n", print_ip(trg),
+			print_ip(dp->src));
+
+		dsr_rrep_send(srt_rev, srt_cat);
+
+		kfree(srt_cat);
+	}
+	return pending;
+}
+
 int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 {
 	struct in_addr myaddr;
 	struct in_addr trg;
 	struct dsr_srt *srt_rev, *srt_rc;
 	int action = DSR_PKT_NONE;
-	int i, n;
+	int i, n, pending = 0;
 
 	LOG_DBG("DSR RREQ\n");
 
@@ -528,10 +1002,19 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 
 	if (dsr_rreq_duplicate(dp->src, trg, ntohs(rreq_opt->id))) {
 		LOG_DBG("Duplicate RREQ from %s\n", print_ip(dp->src));
+		rreq_fwd_duplicate(dp->src, trg, ntohs(rreq_opt->id));
 		return DSR_PKT_DROP;
 	}
 
-	rreq_tbl_add_id(dp->src, trg, ntohs(rreq_opt->id));
+	/* A RREQ whose ID cannot be remembered would have all its copies
+	 * rebroadcast */
+	if (rreq_tbl_add_id(dp->src, trg, ntohs(rreq_opt->id),
+			    DSR_RREQ_ADDRS_LEN(rreq_opt) /
+			    sizeof(struct in_addr) + 1) < 0) {
+		LOG_DBG("RREQ table full, dropping RREQ from %s\n",
+			print_ip(dp->src));
+		return DSR_PKT_DROP;
+	}
 
 	dp->srt = dsr_srt_new(dp->src, myaddr, DSR_RREQ_ADDRS_LEN(rreq_opt),
 			      (char *)rreq_opt->addrs);
@@ -567,25 +1050,30 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 	/* Send buffered packets */
 	send_buf_set_verdict(SEND_BUF_SEND, srt_rev->dst);
 
+	n = DSR_RREQ_ADDRS_LEN(rreq_opt) / sizeof(struct in_addr);
+
 	if (rreq_opt->target == myaddr.s_addr) {
 
 		LOG_DBG("RREQ OPT for me - Send RREP\n");
 
+		dsr_rrep_send(srt_rev, dp->srt);
+                
+		action = DSR_PKT_NONE;
+
+		/* Keep looking for the other targets of a multi-target RREQ */
+		if (dp->rreq_trg_opt && dsr_rreq_trg_reply(dp, srt_rev))
+			goto rreq_forward;
+
 		/* According to the draft, the dest addr in the IP header must
 		 * be updated with the target address */
 #ifdef NS2
 		dp->nh.iph->daddr() = (nsaddr_t) rreq_opt->target;
 #else
-		dp->nh.iph->daddr = rreq_opt->target;
+		dsr_ip_set_daddr(dp->nh.iph, rreq_opt->target);
 #endif
-		dsr_rrep_send(srt_rev, dp->srt);
-                
-		action = DSR_PKT_NONE;
 		goto out;
 	} 
 	
-	n = DSR_RREQ_ADDRS_LEN(rreq_opt) / sizeof(struct in_addr);
-	
 	if (dp->srt->src.s_addr == myaddr.s_addr)
 		return DSR_PKT_DROP;
 	
@@ -595,8 +1083,16 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 			goto out;
 		}
 
+	/* Answer the additional targets of a multi-target RREQ */
+	if (dp->rreq_trg_opt)
+		pending = dsr_rreq_trg_reply(dp, srt_rev);
+
 	/* TODO: Check Blacklist */
-	srt_rc = lc_srt_find(myaddr, trg);
+	srt_rc = NULL;
+
+	/* Only build the route when the link cache says there is one */
+	if (lc_srt_exists(myaddr, trg))
+		srt_rc = lc_srt_find(myaddr, trg);
 	
 	if (srt_rc) {
 		struct dsr_srt *srt_cat;
@@ -620,21 +1116,29 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 			kfree(srt_cat);
 			goto rreq_forward;				
 		}
-#ifdef NS2
-		dp->nh.iph->daddr() = (nsaddr_t) rreq_opt->target;
-#else
-		dp->nh.iph->daddr = rreq_opt->target;
-#endif
 		LOG_DBG("Sending cached RREP to %s\n", print_ip(dp->src));
 		dsr_rrep_send(srt_rev, srt_cat);
 		
 		action = DSR_PKT_NONE;	
 		
 		kfree(srt_cat);
+
+		if (pending)
+			goto rreq_forward;
+#ifdef NS2
+		dp->nh.iph->daddr() = (nsaddr_t) rreq_opt->target;
+#else
+		dsr_ip_set_daddr(dp->nh.iph, rreq_opt->target);
+#endif
 	} else {
 
 	rreq_forward:	
-		dsr_pkt_alloc_opts_expand(dp, sizeof(struct in_addr));
+		if (!dsr_pkt_alloc_opts_expand(dp, sizeof(struct in_addr))) {
+			action = DSR_PKT_DROP;
+			goto out;
+		}
+		/* The options may have moved to a new buffer */
+		rreq_opt = dp->rreq_opt;
 
 		if (!DSR_LAST_OPT(dp, rreq_opt)) {
 			char *to, *from;
@@ -663,6 +1167,106 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 	return action;
 }
 
+void NSCLASS rreq_fwd_timeout(unsigned long data)
+{
+	struct rreq_fwd_entry *e = (struct rreq_fwd_entry *)data;
+	struct dsr_pkt *dp;
+	unsigned int dups;
+
+	write_lock_bh(&rreq_fwd_q.lock);
+	__tbl_detach(&rreq_fwd_q, &e->l);
+	write_unlock_bh(&rreq_fwd_q.lock);
+
+	dp = e->dp;
+	dups = e->dups;
+
+	kfree(e);
+
+	if (dups >= ConfVal(RequestDuplicateThreshold)) {
+		LOG_DBG("RREQ from %s heard %u times, not forwarding\n",
+			print_ip(dp->src), dups);
+		rreq_stats.fwd_dropped++;
+		dsr_pkt_free(dp);
+		return;
+	}
+	rreq_stats.forwarded++;
+
+	XMIT(dp);
+}
+
+/* Count a received duplicate of a RREQ that waits to be rebroadcast */
+void NSCLASS rreq_fwd_duplicate(struct in_addr initiator,
+				struct in_addr target, unsigned short id)
+{
+	list_t *pos;
+
+	write_lock_bh(&rreq_fwd_q.lock);
+
+	list_for_each(pos, &rreq_fwd_q.head) {
+		struct rreq_fwd_entry *e = (struct rreq_fwd_entry *)pos;
+
+		if (e->initiator.s_addr == initiator.s_addr &&
+		    e->target.s_addr == target.s_addr && e->id == id) {
+			e->dups++;
+			break;
+		}
+	}
+	write_unlock_bh(&rreq_fwd_q.lock);
+}
+
+/* Rebroadcast a RREQ. Unless disabled, the rebroadcast is first dropped with
+ * probability 1 - RequestForwardProbability, and then held back for up to
+ * RequestForwardDelay so that it can be suppressed by duplicates. */
+void NSCLASS dsr_rreq_forward(struct dsr_pkt *dp)
+{
+	struct rreq_fwd_entry *e;
+	struct timeval expires;
+	usecs_t delay = ConfValToUsecs(RequestForwardDelay);
+	unsigned int prob = ConfVal(RequestForwardProbability);
+
+	if (prob < 100 && rreq_fwd_random(100) >= prob) {
+		LOG_DBG("Dropping RREQ from %s (p=%u%%)\n",
+			print_ip(dp->src), prob);
+		rreq_stats.fwd_dropped++;
+		dsr_pkt_free(dp);
+		return;
+	}
+
+	if (delay == 0 || ConfVal(RequestDuplicateThreshold) == 0)
+		goto xmit;
+
+	e = (struct rreq_fwd_entry *)kmalloc(sizeof(struct rreq_fwd_entry),
+					     GFP_ATOMIC);
+	if (!e)
+		goto xmit;
+
+	e->initiator = dp->src;
+	e->target.s_addr = dp->rreq_opt->target;
+	e->id = ntohs(dp->rreq_opt->id);
+	e->dups = 0;
+	e->dp = dp;
+	tw_timer_init(&e->timer, &NSCLASS rreq_fwd_timeout, (unsigned long)e);
+
+	gettime(&expires);
+	timeval_add_usecs(&expires, rreq_fwd_random(delay));
+
+	write_lock_bh(&rreq_fwd_q.lock);
+
+	if (__tbl_add_tail(&rreq_fwd_q, &e->l) < 0) {
+		write_unlock_bh(&rreq_fwd_q.lock);
+		kfree(e);
+		goto xmit;
+	}
+	tw_timer_set(&e->timer, &expires);
+
+	write_unlock_bh(&rreq_fwd_q.lock);
+
+	return;
+      xmit:
+	rreq_stats.forwarded++;
+	XMIT(dp);
+}
+
 #ifdef __KERNEL__
 
 static int
@@ -685,6 +1289,7 @@ rreq_tbl_proc_info(char *buffer, char **start, off_t offset, int length, int *eo
 
 int __init NSCLASS rreq_tbl_init(void)
 {
+	int i;
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
@@ -701,22 +1306,55 @@ int __init NSCLASS rreq_tbl_init(void)
 #endif
 
 	INIT_TBL(&rreq_tbl, RREQ_TBL_MAX_LEN);
+	INIT_TBL(&rreq_fwd_q, RREQ_FWD_Q_MAX_LEN);
+
+	tw_timer_init(&rreq_coalesce_timer, &NSCLASS rreq_coalesce_timeout, 0);
+
+	for (i = 0; i < RREQ_TBL_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&rreq_hash[i]);
+
+	memset(&rreq_stats, 0, sizeof(struct rreq_tbl_stats));
+	memset(&rreq_bucket, 0, sizeof(struct rreq_bucket));
+	rreq_bucket.credit = -1;
 
 	return 0;
 }
 
-void __exit NSCLASS rreq_tbl_cleanup(void)
+void NSCLASS rreq_tbl_cleanup(void)
 {
 	struct rreq_tbl_entry *e;
 
+	tw_timer_del_sync(&rreq_coalesce_timer);
+
 	while ((e = (struct rreq_tbl_entry *)tbl_detach_first(&rreq_tbl))) {
-		del_timer_sync(e->timer);
-#ifdef NS2
-		delete e->timer;
-#else
-		kfree(e->timer);
-#endif
-		tbl_flush(&e->rreq_id_tbl, crit_none);
+		tw_timer_del_sync(&e->timer);
+		list_del(&e->hl);
+		kfree(e);
+	}
+
+	/* Drop the RREQs waiting to be rebroadcast. If the timer of one has
+	 * already fired, its handler removes it. */
+	while (1) {
+		struct rreq_fwd_entry *f;
+
+		write_lock_bh(&rreq_fwd_q.lock);
+
+		if (TBL_EMPTY(&rreq_fwd_q)) {
+			write_unlock_bh(&rreq_fwd_q.lock);
+			break;
+		}
+		f = (struct rreq_fwd_entry *)TBL_FIRST(&rreq_fwd_q);
+
+		if (!tw_timer_del(&f->timer)) {
+			write_unlock_bh(&rreq_fwd_q.lock);
+			continue;
+		}
+		__tbl_detach(&rreq_fwd_q, &f->l);
+
+		write_unlock_bh(&rreq_fwd_q.lock);
+
+		dsr_pkt_free(f->dp);
+		kfree(f);
 	}
 #ifdef __KERNEL__
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
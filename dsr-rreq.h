@@ -30,21 +30,73 @@ struct dsr_rreq_opt {
 #define DSR_RREQ_TOT_LEN IP_HDR_LEN + sizeof(struct dsr_opt_hdr) + sizeof(struct dsr_rreq_opt)
 #define DSR_RREQ_ADDRS_LEN(rreq_opt) (rreq_opt->length - 6)
 
+/* Experimental option that carries the additional targets of a
+ * multi-target RREQ. It precedes the RREQ option, which holds the first
+ * target, so that the RREQ option stays last and can grow in place. */
+struct dsr_rreq_trg_opt {
+	u_int8_t type;
+	u_int8_t length;
+	u_int32_t targets[0];
+};
+
+#define DSR_RREQ_TRG_HDR_LEN sizeof(struct dsr_rreq_trg_opt)
+#define DSR_RREQ_TRG_NUM(trg_opt) ((trg_opt)->length / sizeof(u_int32_t))
+#define DSR_RREQ_MAX_TRG 8	/* Targets in one RREQ */
+
+#define RREQ_TBL_HASH_SIZE 32	/* Must be a power of two */
+
+#define RREQ_LATENCY_BUCKETS 8
+
+/* A token bucket for originated RREQs. The credit is kept in usecs: it
+ * grows with time up to the burst size, and each RREQ costs the interval
+ * of one token. A negative credit means a full bucket. */
+struct rreq_bucket {
+	long credit;
+	struct timeval last;
+};
+
+/* Counters for the negative route cache and route discovery */
+struct rreq_tbl_stats {
+	unsigned int holdoffs;	/* Destinations put in holdoff */
+	unsigned int suppressed;	/* Discoveries suppressed by holdoff */
+	unsigned int cleared;	/* Holdoffs cleared by a RREP or RREQ */
+	/* Discovery latency histograms for discoveries started at TTL 1 and
+	 * at a TTL seeded from the last known hop count */
+	unsigned int latency[2][RREQ_LATENCY_BUCKETS];
+	unsigned int discoveries;	/* Route discoveries started */
+	unsigned int sent;	/* RREQs originated */
+	unsigned int forwarded;	/* RREQs rebroadcast */
+	unsigned int fwd_dropped;	/* Rebroadcasts suppressed */
+	unsigned int rate_limited;	/* RREQs delayed by the global limit */
+	unsigned int target_limited;	/* RREQs delayed by a target's budget */
+	unsigned int coalesced;	/* Targets sent along in another's RREQ */
+};
+
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
 void rreq_tbl_set_max_len(unsigned int max_len);
 int dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt);
-int rreq_tbl_route_discovery_cancel(struct in_addr dst);
+int rreq_tbl_route_discovery_cancel(struct in_addr dst, int hops);
 int dsr_rreq_route_discovery(struct in_addr target);
 int dsr_rreq_send(struct in_addr target, int ttl);
+int dsr_rreq_send_multi(struct in_addr *targets, int n, int ttl);
+int dsr_rreq_trg_reply(struct dsr_pkt *dp, struct dsr_srt *srt_rev);
+void rreq_coalesce_timeout(unsigned long data);
 void rreq_tbl_timeout(unsigned long data);
 struct rreq_tbl_entry *__rreq_tbl_entry_create(struct in_addr node_addr);
 struct rreq_tbl_entry *__rreq_tbl_add(struct in_addr node_addr);
 int rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
-		    unsigned short id);
+		    unsigned short id, int hops);
+int rreq_tbl_stats_print(char *buf);
+long __rreq_rate_limit(struct rreq_tbl_entry *e, struct timeval *now);
+void dsr_rreq_forward(struct dsr_pkt *dp);
+void rreq_fwd_duplicate(struct in_addr initiator, struct in_addr target,
+			unsigned short id);
+void rreq_fwd_timeout(unsigned long data);
 int dsr_rreq_duplicate(struct in_addr initiator, struct in_addr target,
 		       unsigned int id);
+int dsr_rreq_holdoff(struct in_addr target);
 
 int rreq_tbl_init(void);
 void rreq_tbl_cleanup(void);
@@ -23,6 +23,7 @@
 #include "link-cache.h"
 #include "neigh.h"
 #include "dsr-rrep.h"
+#include "dsr-io.h"
 #include "debug.h"
 
 struct in_addr dsr_srt_next_hop(struct dsr_srt *srt, int sleft)
@@ -337,6 +338,10 @@ int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 
 	LOG_DBG("SR: %s\n", print_srt(dp->srt));
 
+	/* The packet must still fit the link with this route */
+	if (dsr_pmtu_check(dp, len) < 0)
+		return -1;
+
 	buf = dsr_pkt_alloc_opts(dp, len);
 
 	if (!buf) {
@@ -388,39 +393,11 @@ int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 	return 0;
 }
 
-int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
+/* Update the neighbor table and the route cache from the source route of a
+ * received packet */
+void NSCLASS dsr_srt_learn(struct dsr_pkt *dp)
 {
-	struct in_addr next_hop_intended;
 	struct in_addr myaddr = my_addr();
-	int n;
-
-	if (!dp || !srt_opt)
-		return DSR_PKT_ERROR;
-	
-	dp->srt_opt = srt_opt;
-
-	/* We should add this source route info to the cache... */
-	dp->srt = dsr_srt_new(dp->src, dp->dst, srt_opt->length,
-			      (char *)srt_opt->addrs);
-
-	if (!dp->srt) {
-		LOG_DBG("Create source route failed\n");
-		return DSR_PKT_ERROR;
-	}
-	n = dp->srt->laddrs / sizeof(struct in_addr);
-
-	LOG_DBG("SR: %s sleft=%d\n", print_srt(dp->srt), srt_opt->sleft);
-
-	/* Copy salvage field */
-	dp->salvage = dp->srt_opt->salv;
-
-	next_hop_intended = dsr_srt_next_hop(dp->srt, srt_opt->sleft);
-	dp->prv_hop = dsr_srt_prev_hop(dp->srt, srt_opt->sleft - 1);
-	dp->nxt_hop = dsr_srt_next_hop(dp->srt, srt_opt->sleft - 1);
-
-	LOG_DBG("next_hop=%s prev_hop=%s next_hop_intended=%s\n",
-                print_ip(dp->nxt_hop),
-                print_ip(dp->prv_hop), print_ip(next_hop_intended));
 
 	neigh_tbl_add(dp->prv_hop, dp->mac.ethh);
 	
@@ -455,6 +432,47 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 			kfree(srt_split);
 		}
 	}
+}
+
+int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
+{
+	struct in_addr next_hop_intended;
+	struct in_addr myaddr = my_addr();
+	int n;
+
+	if (!dp || !srt_opt)
+		return DSR_PKT_ERROR;
+	
+	dp->srt_opt = srt_opt;
+
+	/* We should add this source route info to the cache... */
+	dp->srt = dsr_srt_new(dp->src, dp->dst, srt_opt->length,
+			      (char *)srt_opt->addrs);
+
+	if (!dp->srt) {
+		LOG_DBG("Create source route failed\n");
+		return DSR_PKT_ERROR;
+	}
+	n = dp->srt->laddrs / sizeof(struct in_addr);
+
+	LOG_DBG("SR: %s sleft=%d\n", print_srt(dp->srt), srt_opt->sleft);
+
+	/* Copy salvage field */
+	dp->salvage = dp->srt_opt->salv;
+
+	next_hop_intended = dsr_srt_next_hop(dp->srt, srt_opt->sleft);
+	dp->prv_hop = dsr_srt_prev_hop(dp->srt, srt_opt->sleft - 1);
+	dp->nxt_hop = dsr_srt_next_hop(dp->srt, srt_opt->sleft - 1);
+
+	LOG_DBG("next_hop=%s prev_hop=%s next_hop_intended=%s\n",
+                print_ip(dp->nxt_hop),
+                print_ip(dp->prv_hop), print_ip(next_hop_intended));
+
+	/* Packets of a receive batch that arrived from the same previous hop
+	 * along the same source route teach us nothing new after the first */
+	if (!dsr_rx_batch_seen(dp))
+		dsr_srt_learn(dp);
+
 	/* Automatic route shortening - Check if this node is the
 	 * intended next hop. If not, is it part of the remaining
 	 * source route? */
@@ -506,6 +524,11 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 		return DSR_PKT_SEND_ICMP;
 	}
 
+	/* Rewriting the options makes them private to the packet */
+	if (dsr_pkt_opts_cow(dp) < 0)
+		return DSR_PKT_ERROR;
+
+	srt_opt = dp->srt_opt;
 	srt_opt->sleft--;
 
 	/* TODO: check for multicast address in next hop or dst */
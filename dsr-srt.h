@@ -98,6 +98,7 @@ struct dsr_srt *dsr_srt_new_split(struct dsr_srt *srt, struct in_addr addr);
 
 int dsr_srt_add(struct dsr_pkt *dp);
 int dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt);
+void dsr_srt_learn(struct dsr_pkt *dp);
 
 #endif				/* NO_DECLS */
 
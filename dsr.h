@@ -22,6 +22,8 @@
 #include <linux/skbuff.h>
 #include <linux/ip.h>
 #include <linux/time.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
 #ifdef KERNEL26
 #include <linux/jiffies.h>
 #endif
@@ -45,10 +47,9 @@
 #define IPPROTO_DSR 168		/* Is this correct? */
 #endif
 #define IP_HDR_LEN 20
-#define DSR_OPTS_MAX_SIZE 50	/* This is used to reduce the MTU of the DSR *
-				 * device so that packets are not too big after
-				 * adding the DSR header. A better solution
-				 * should probably be found... */
+#define DSR_OPTS_MAX_SIZE 50	/* Size of the DSR header in ns-2 packets. In
+				 * the kernel, the room for the DSR header is
+				 * sized per route, see dsr_pmtu_check(). */
 
 enum confval {
 #ifdef ENABLE_DEBUG
@@ -78,6 +79,20 @@ enum confval {
 	PassiveAckTimeout,
 	GratReplyHoldOff,
 	MAX_SALVAGE_COUNT,
+	UnreachableHoldoff,
+	MaxUnreachableHoldoff,
+	AckAggregationDelay,
+	NeighborTableSize,
+	NetworkDiameter,
+	SeedRequestTTL,
+	RequestForwardDelay,
+	RequestDuplicateThreshold,
+	RequestForwardProbability,
+	RequestRateLimit,
+	RequestRateBurst,
+	TargetRequestInterval,
+	TargetRequestBurst,
+	RequestCoalesceDelay,
 	CONFVAL_MAX,
 };
 
@@ -95,7 +110,9 @@ enum confval_type {
 #define MAINT_BUF_MAX_LEN 100
 #define RREQ_TBL_MAX_LEN 64	/* Should be enough */
 #define SEND_BUF_MAX_LEN 100
+#define NEIGH_TBL_MAX_LEN 50
 #define RREQ_TLB_MAX_ID 16
+#define RREQ_FWD_Q_MAX_LEN 64
 
 static struct {
 	const char *name;
@@ -128,18 +145,44 @@ static struct {
 		"TryPassiveAcks", 1, QUANTA}, {
 		"PassiveAckTimeout", 100, MILLISECONDS}, {
 		"GratReplyHoldOff", 1, SECONDS}, {
-		"MAX_SALVAGE_COUNT", 15, QUANTA}
+		"MAX_SALVAGE_COUNT", 15, QUANTA}, {
+		"UnreachableHoldoff", 10, SECONDS}, {
+		"MaxUnreachableHoldoff", 300, SECONDS}, {
+		"AckAggregationDelay", 10, MILLISECONDS}, {
+		"NeighborTableSize", NEIGH_TBL_MAX_LEN, QUANTA}, {
+		"NetworkDiameter", 16, QUANTA}, {
+		"SeedRequestTTL", 1, BINARY}, {
+		"RequestForwardDelay", 10, MILLISECONDS}, {
+		"RequestDuplicateThreshold", 3, QUANTA}, {
+		"RequestForwardProbability", 100, QUANTA}, {
+		"RequestRateLimit", 20, QUANTA}, {
+		"RequestRateBurst", 10, QUANTA}, {
+		"TargetRequestInterval", 500, MILLISECONDS}, {
+		"TargetRequestBurst", 4, QUANTA}, {
+		"RequestCoalesceDelay", 0, MILLISECONDS}
 };
 
-struct dsr_node {
+/* The configuration and addresses of the node, which are read on every
+ * packet. A published snapshot is never modified. Writers copy it, change
+ * the copy and swap it in under the node lock, while readers only need an
+ * RCU read side section. */
+struct dsr_conf {
 	struct in_addr ifaddr;
 	struct in_addr bcaddr;
 	unsigned int confvals[CONFVAL_MAX];
 #ifdef __KERNEL__
+	struct rcu_head rcu;
+#endif
+};
+
+struct dsr_node {
+#ifdef __KERNEL__
+	struct dsr_conf *conf;	/* RCU protected */
 	char slave_ifname[IFNAMSIZ];
 	struct net_device *slave_dev;
 	struct in_device *slave_indev;
-	struct net_device_stats stats;
+	struct net_device_stats stats;	/* Sum of the counters below */
+	struct dsr_dev_stats *pcpu_stats;
 	spinlock_t lock;
 #endif
 };
@@ -166,6 +209,23 @@ struct dsr_node {
 #define SKB_SET_MAC_HDR(skb, offset) skb_set_mac_header(skb, offset)
 #define SKB_SET_NETWORK_HDR(skb, offset) skb_set_network_header(skb, offset)
 #endif
+
+/* Incremental checksum updates (RFC 1624) are only in kernels from 2.6.22 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+static inline void csum_replace2(u16 *sum, u16 from, u16 to)
+{
+	u32 s = (u16)~*sum + (u16)~from + to;
+
+	s = (s & 0xffff) + (s >> 16);
+	*sum = ~(s + (s >> 16));
+}
+
+static inline void csum_replace4(u16 *sum, u32 from, u32 to)
+{
+	csum_replace2(sum, from >> 16, to >> 16);
+	csum_replace2(sum, from & 0xffff, to & 0xffff);
+}
+#endif
 #endif				/* __KERNEL__ */
 
 #ifdef __KERNEL__
@@ -177,29 +237,23 @@ extern struct dsr_node *dsr_node;
 
 static inline unsigned int get_confval(enum confval cv)
 {
+	struct dsr_conf *conf;
 	unsigned int val = 0;
 
-	if (dsr_node) {
-		spin_lock_bh(&dsr_node->lock);
-		val = dsr_node->confvals[cv];
-		spin_unlock_bh(&dsr_node->lock);
-	}
-	return val;
-}
-
-static inline int set_confval(enum confval cv, unsigned int val)
-{
-	if (dsr_node) {
-		spin_lock_bh(&dsr_node->lock);
-		dsr_node->confvals[cv] = val;
-		spin_unlock_bh(&dsr_node->lock);
-	} else
-		return -1;
+	rcu_read_lock();
+	if (dsr_node && (conf = rcu_dereference(dsr_node->conf)))
+		val = conf->confvals[cv];
+	rcu_read_unlock();
 
 	return val;
 }
 
-static inline void dsr_node_init(struct dsr_node *dn, char *ifname)
+int set_confval(enum confval cv, unsigned int val);
+int dsr_node_set_addrs(struct dsr_node *dn, struct in_addr ifaddr,
+		       struct in_addr bcaddr);
+void dsr_node_release_conf(struct dsr_node *dn);
+
+static inline int dsr_node_init(struct dsr_node *dn, char *ifname)
 {
 	int i;
 	dn->slave_indev = NULL;
@@ -211,20 +265,30 @@ static inline void dsr_node_init(struct dsr_node *dn, char *ifname)
 
 	spin_lock_init(&dn->lock);
 
+	dn->conf = kmalloc(sizeof(struct dsr_conf), GFP_KERNEL);
+
+	if (!dn->conf)
+		return -ENOMEM;
+
+	memset(dn->conf, 0, sizeof(struct dsr_conf));
+
 	for (i = 0; i < CONFVAL_MAX; i++) {
-		dn->confvals[i] = confvals_def[i].val;
+		dn->conf->confvals[i] = confvals_def[i].val;
 	}
+	return 0;
 }
 
 static inline struct in_addr my_addr(void)
 {
-	static struct in_addr my_addr;
-	if (dsr_node) {
-		spin_lock_bh(&dsr_node->lock);
-		my_addr = dsr_node->ifaddr;
-		spin_unlock_bh(&dsr_node->lock);
-	}
-	return my_addr;
+	struct in_addr addr = { 0 };
+	struct dsr_conf *conf;
+
+	rcu_read_lock();
+	if (dsr_node && (conf = rcu_dereference(dsr_node->conf)))
+		addr = conf->ifaddr;
+	rcu_read_unlock();
+
+	return addr;
 }
 
 static inline unsigned long time_add_msec(unsigned long msecs)
@@ -52,6 +52,7 @@ static struct lc_graph LC;
 
 struct lc_node {
 	list_t l;
+	list_t hl;		/* In the node hash */
 	struct in_addr addr;
 	unsigned int links;
 	unsigned int cost;	/* Cost estimate from source when running Dijkstra */
@@ -81,27 +82,47 @@ struct cheapest_node {
 static int lc_print(struct lc_graph *LC, char *buf);
 #endif
 
-static inline void __lc_link_del(struct lc_graph *lc, struct lc_link *link)
+static inline unsigned int lc_hash_idx(struct in_addr addr)
 {
-	/* Also free the nodes if they lack other links */
-	if (--link->src->links == 0)
-		__tbl_del(&lc->nodes, &link->src->l);
+	unsigned int h = ntohl(addr.s_addr);
 
-	if (--link->dst->links == 0)
-		__tbl_del(&lc->nodes, &link->dst->l);
+	h ^= (h >> 16);
+	h ^= (h >> 8);
 
-	__tbl_del(&lc->links, &link->l);
+	return h & (LC_NODE_HASH_SIZE - 1);
 }
 
-static inline int crit_addr(void *pos, void *addr)
+static inline struct lc_node *__lc_node_find(struct lc_graph *lc,
+					     struct in_addr addr)
 {
-	struct in_addr *a = (struct in_addr *)addr;
-	struct lc_node *p = (struct lc_node *)pos;
+	list_t *pos;
 
-	if (p->addr.s_addr == a->s_addr)
-		return 1;
-	return 0;
+	list_for_each(pos, &lc->node_hash[lc_hash_idx(addr)]) {
+		struct lc_node *n = list_entry(pos, struct lc_node, hl);
+
+		if (n->addr.s_addr == addr.s_addr)
+			return n;
+	}
+	return NULL;
 }
+
+static inline void __lc_link_del(struct lc_graph *lc, struct lc_link *link)
+{
+	/* Also free the nodes if they lack other links */
+	if (--link->src->links == 0) {
+		list_del(&link->src->hl);
+		__tbl_del(&lc->nodes, &link->src->l);
+	}
+	if (--link->dst->links == 0) {
+		list_del(&link->dst->hl);
+		__tbl_del(&lc->nodes, &link->dst->l);
+	}
+	__tbl_del(&lc->links, &link->l);
+
+	/* The shortest path tree is stale */
+	lc->src = NULL;
+}
+
 static inline int crit_link_query(void *pos, void *query)
 {
 	struct lc_link *p = (struct lc_link *)pos;
@@ -281,7 +302,9 @@ static int __lc_link_tbl_add(struct tbl *t, struct lc_node *src,
 		dst->links++;
 
 		res = 1;
-	} else
+	} else if (link->cost != (unsigned int)cost)
+		res = 1;
+	else
 		res = 0;
 
 	link->status = status;
@@ -299,7 +322,7 @@ int NSCLASS __lc_link_add(struct in_addr src, struct in_addr dst,
 	struct lc_node *sn, *dn;
 	int res;
 
-	sn = (struct lc_node *)__tbl_find(&LC.nodes, &src, crit_addr);
+	sn = __lc_node_find(&LC, src);
 
 	if (!sn) {
 		sn = lc_node_create(src);
@@ -309,9 +332,10 @@ int NSCLASS __lc_link_add(struct in_addr src, struct in_addr dst,
 			return -1;
 		}
 		__tbl_add_tail(&LC.nodes, &sn->l);
+		list_add(&sn->hl, &LC.node_hash[lc_hash_idx(src)]);
 	}
 
-	dn = (struct lc_node *)__tbl_find(&LC.nodes, &dst, crit_addr);
+	dn = __lc_node_find(&LC, dst);
 
 	if (!dn) {
 		dn = lc_node_create(dst);
@@ -320,10 +344,15 @@ int NSCLASS __lc_link_add(struct in_addr src, struct in_addr dst,
 			return -1;
 		}
 		__tbl_add_tail(&LC.nodes, &dn->l);
+		list_add(&dn->hl, &LC.node_hash[lc_hash_idx(dst)]);
 	}
 
 	res = __lc_link_tbl_add(&LC.links, sn, dn, timeout, status, cost);
 
+	/* A new link, or a new cost, makes the shortest path tree stale */
+	if (res > 0)
+		LC.src = NULL;
+
 	if (res) {
 #ifdef LC_TIMER
 #ifdef NS2
@@ -431,7 +460,7 @@ void NSCLASS __dijkstra(struct in_addr src)
 
 	__dijkstra_init_single_source(&LC.nodes, src);
 
-	src_node = (struct lc_node *)__tbl_find(&LC.nodes, &src, crit_addr);
+	src_node = __lc_node_find(&LC, src);
 
 	if (!src_node)
 		return;
@@ -466,10 +495,11 @@ struct dsr_srt *NSCLASS lc_srt_find(struct in_addr src, struct in_addr dst)
 
 	write_lock_bh(&LC.lock);
 
-/* 	if (!LC.src || LC.src->addr.s_addr != src.s_addr) */
-	__dijkstra(src);
+	/* The shortest path tree is kept until the graph changes */
+	if (!LC.src || LC.src->addr.s_addr != src.s_addr)
+		__dijkstra(src);
 
-	dst_node = (struct lc_node *)__tbl_find(&LC.nodes, &dst, crit_addr);
+	dst_node = __lc_node_find(&LC, dst);
 
 	if (!dst_node) {
 		LC_DBG("%s not found\n", print_ip(dst));
@@ -545,6 +575,48 @@ struct dsr_srt *NSCLASS lc_srt_find(struct in_addr src, struct in_addr dst)
 	return srt;
 }
 
+/* Returns the hop count of the cached route from src to dst, or 0 if there
+ * is none. Once the shortest path tree is computed, this is a hash lookup,
+ * so that it is cheap to check before building a route with
+ * lc_srt_find(). */
+int NSCLASS lc_srt_exists(struct in_addr src, struct in_addr dst)
+{
+	struct lc_node *dst_node;
+	int hops = 0;
+
+	if (src.s_addr == dst.s_addr)
+		return 0;
+
+	read_lock_bh(&LC.lock);
+
+	if (!LC.src || LC.src->addr.s_addr != src.s_addr) {
+		read_unlock_bh(&LC.lock);
+		write_lock_bh(&LC.lock);
+
+		if (!LC.src || LC.src->addr.s_addr != src.s_addr)
+			__dijkstra(src);
+
+		dst_node = __lc_node_find(&LC, dst);
+
+		if (dst_node && dst_node->cost != LC_COST_INF &&
+		    dst_node->pred)
+			hops = dst_node->hops;
+
+		write_unlock_bh(&LC.lock);
+
+		return hops;
+	}
+
+	dst_node = __lc_node_find(&LC, dst);
+
+	if (dst_node && dst_node->cost != LC_COST_INF && dst_node->pred)
+		hops = dst_node->hops;
+
+	read_unlock_bh(&LC.lock);
+
+	return hops;
+}
+
 int NSCLASS
 lc_srt_add(struct dsr_srt *srt, usecs_t timeout, unsigned short flags)
 {
@@ -594,6 +666,8 @@ int lc_srt_del(struct in_addr src, struct in_addr dst)
 
 void NSCLASS lc_flush(void)
 {
+	int i;
+
         write_lock_bh(&LC.lock);
 #ifdef LC_TIMER
 #ifdef NS2
@@ -607,6 +681,9 @@ void NSCLASS lc_flush(void)
 	__tbl_flush(&LC.links, NULL);
 	__tbl_flush(&LC.nodes, NULL);
 
+	for (i = 0; i < LC_NODE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&LC.node_hash[i]);
+
 	LC.src = NULL;
 
 	write_unlock_bh(&LC.lock);
@@ -698,6 +775,7 @@ static int lc_proc_info(char *buffer, char **start, off_t offset, int length, in
 
 EXPORT_SYMBOL(lc_srt_add);
 EXPORT_SYMBOL(lc_srt_find);
+EXPORT_SYMBOL(lc_srt_exists);
 EXPORT_SYMBOL(lc_flush);
 EXPORT_SYMBOL(lc_link_del);
 EXPORT_SYMBOL(lc_link_add);
@@ -709,6 +787,8 @@ module_exit(lc_cleanup);
 
 int __init NSCLASS lc_init(void)
 {
+	int i;
+
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
 
@@ -735,6 +815,9 @@ int __init NSCLASS lc_init(void)
 	INIT_TBL(&LC.links, LC_LINKS_MAX);
 	INIT_TBL(&LC.nodes, LC_NODES_MAX);
 
+	for (i = 0; i < LC_NODE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&LC.node_hash[i]);
+
 	LC.src = NULL;
 
 	return 0;
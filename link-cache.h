@@ -15,10 +15,14 @@
 
 #ifndef NO_GLOBALS
 
+#define LC_NODE_HASH_SIZE 64	/* Must be a power of two */
+
 struct lc_graph {
 	struct tbl nodes;
 	struct tbl links;
-	struct lc_node *src;
+	list_t node_hash[LC_NODE_HASH_SIZE];
+	struct lc_node *src;	/* Source of the current shortest path tree,
+				 * NULL when the graph has changed since */
 #ifdef __KERNEL__
 	struct timer_list timer;
 	rwlock_t lock;
@@ -40,6 +44,7 @@ int lc_link_add(struct in_addr src, struct in_addr dst,
 void lc_garbage_collect_set(void);
 void lc_garbage_collect(unsigned long data);
 struct dsr_srt *lc_srt_find(struct in_addr src, struct in_addr dst);
+int lc_srt_exists(struct in_addr src, struct in_addr dst);
 int lc_srt_add(struct dsr_srt *srt, unsigned long timeout,
 	       unsigned short flags);
 void lc_flush(void);
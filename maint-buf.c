@@ -26,128 +26,343 @@
 #include "dsr-srt.h"
 #include "dsr-opt.h"
 #include "timer.h"
+#include "timer-wheel.h"
 #include "maint-buf.h"
 
 #define MAINT_BUF_PROC_FS_NAME "maint_buf"
 
 TBL(maint_buf, MAINT_BUF_MAX_LEN);
 
-static DSRUUTimer ack_timer;
+static struct tw_timer ack_timer;
+static struct maint_buf_idx maint_idx;
+static struct maint_buf_stats maint_stats;
 
 #endif /* NS2 */
 
+struct maint_neigh;
+
 struct maint_entry {
 	list_t l;
+	list_t nl;		/* Next hop list, ordered by ID */
+	struct maint_neigh *neigh;
+	unsigned int heap_idx;	/* Position in retransmission heap */
 	struct in_addr nxt_hop;
 	unsigned int rexmt;
 	unsigned short id;
 	struct timeval tx_time, expires;
 	usecs_t rto;
 	int ack_req_sent;
-	struct dsr_pkt *dp;
+	int passive;		/* Waiting to overhear the next hop forward */
+	struct in_addr src, dst;
+	unsigned int pkt_id;
+	int sleft;		/* Segments left when we transmitted */
+#ifdef NS2
+	Packet *p;
+#else
+	struct sk_buff *skb;	/* Clone of the transmitted packet */
+#endif
 };
 
-struct maint_buf_query {
-	struct in_addr *nxt_hop;
-	unsigned short *id;
-	usecs_t rtt;
+/* Packets buffered for one next hop */
+struct maint_neigh {
+	list_t l;
+	struct in_addr addr;
+	list_t pkts;
+	unsigned int len;
 };
 
 #ifdef __KERNEL__
 static int maint_buf_print(struct tbl *t, char *buffer);
 #endif
 
-/* Criteria function for deleting packets from buffer based on next hop and
- * id */
-static inline int crit_addr_id_del(void *pos, void *data)
-{
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct maint_buf_query *q = (struct maint_buf_query *)data;
+/* ACK REQs sent by one run of the timeout handler. They are collected under
+ * the lock and sent after it is released */
+#define MAINT_ACK_REQ_BATCH 16
 
-	if (m->nxt_hop.s_addr == q->nxt_hop->s_addr && m->id <= *(q->id)) {
-		struct timeval now;
-		
-		gettime(&now);
-		
-		/* Only update RTO if this was not a retransmission */
-		if (m->id == *(q->id) && m->rexmt == 0)
-			q->rtt = timeval_diff(&now, &m->tx_time);
+struct maint_ack_req {
+	struct in_addr nxt_hop;
+	unsigned short id;
+};
 
-		if (m->dp) {
+/* Release the buffered transmit packet of an entry */
+static inline void maint_entry_free_pkt(struct maint_entry *m)
+{
 #ifdef NS2
-			if (m->dp->p)
-				Packet::free(m->dp->p);
+	if (m->p)
+		Packet::free(m->p);
+	m->p = NULL;
+#else
+	if (m->skb)
+		dev_kfree_skb_any(m->skb);
+	m->skb = NULL;
 #endif
-			dsr_pkt_free(m->dp);
-			return 1;
-		}	
-	}
-	return 0;
 }
 
-/* Criteria function for deleting packets from buffer based on next hop */
-static inline int crit_addr_del(void *pos, void *data)
+/* Parse the buffered transmit packet so that it can be salvaged. The packet
+ * is handed over to the returned dsr_pkt. */
+static struct dsr_pkt *maint_entry_dsr_pkt(struct maint_entry *m)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct maint_buf_query *q = (struct maint_buf_query *)data;
+	struct dsr_pkt *dp;
 
-	if (m->nxt_hop.s_addr == q->nxt_hop->s_addr) {
-		struct timeval now;
-		
-		gettime(&now);
-		
-		if (m->rexmt == 0)
-			q->rtt = timeval_diff(&now, &m->tx_time);
-		
-		if (m->dp) {
 #ifdef NS2
-			if (m->dp->p)
-				Packet::free(m->dp->p);
+	dp = dsr_pkt_alloc(m->p);
+
+	if (!dp)
+		return NULL;
+
+	m->p = NULL;
+#else
+	dp = dsr_pkt_alloc(m->skb);
+
+	if (!dp)
+		return NULL;
+
+	m->skb = NULL;
 #endif
-			dsr_pkt_free(m->dp);
-			return 1;
-		}
+	dp->nxt_hop = m->nxt_hop;
+
+	return dp;
+}
+
+/* Identifies a packet across hops, so that it can be recognized when
+ * overheard */
+static inline unsigned int maint_pkt_id(struct dsr_pkt *dp)
+{
+#ifdef NS2
+	return dp->p ? HDR_CMN(dp->p)->uid() : 0;
+#else
+	return dp->nh.iph ? dp->nh.iph->id : 0;
+#endif
+}
+
+static inline unsigned int maint_hash(struct in_addr addr)
+{
+	unsigned int h = ntohl(addr.s_addr);
+
+	h ^= (h >> 16);
+	h ^= (h >> 8);
+
+	return h & (MAINT_BUF_HASH_SIZE - 1);
+}
+
+static struct maint_neigh *maint_neigh_find(struct maint_buf_idx *idx,
+					    struct in_addr addr)
+{
+	list_t *pos;
+
+	list_for_each(pos, &idx->hash[maint_hash(addr)]) {
+		struct maint_neigh *nb = (struct maint_neigh *)pos;
+
+		if (nb->addr.s_addr == addr.s_addr)
+			return nb;
 	}
-	return 0;
+	return NULL;
 }
 
-/* Criteria function for buffered packets based on next hop */
-static inline int crit_addr(void *pos, void *data)
+/* Min-heap of buffered packets, ordered on retransmission deadline */
+static inline int maint_heap_before(struct maint_entry *a,
+				    struct maint_entry *b)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct in_addr *nxt_hop = (struct in_addr *)data;
+	return timeval_diff(&a->expires, &b->expires) < 0;
+}
 
-	if (m->nxt_hop.s_addr == nxt_hop->s_addr)
-		return 1;
+static inline void maint_heap_set(struct maint_buf_idx *idx, unsigned int i,
+				  struct maint_entry *m)
+{
+	idx->heap[i] = m;
+	m->heap_idx = i;
+}
 
-	return 0;
+static void maint_heap_up(struct maint_buf_idx *idx, unsigned int i)
+{
+	struct maint_entry *m = idx->heap[i];
+
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (!maint_heap_before(m, idx->heap[parent]))
+			break;
+
+		maint_heap_set(idx, i, idx->heap[parent]);
+		i = parent;
+	}
+	maint_heap_set(idx, i, m);
 }
 
-/* Criteria function for buffered packets based on expire time */
-static inline int crit_expires(void *pos, void *data)
+static void maint_heap_down(struct maint_buf_idx *idx, unsigned int i)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
-	struct maint_entry *m_new = (struct maint_entry *)data;
+	struct maint_entry *m = idx->heap[i];
 
-	if (timeval_diff(&m->expires, &m_new->expires) > 0)
-		return 1;
-	return 0;
+	while (2 * i + 1 < idx->heap_len) {
+		unsigned int child = 2 * i + 1;
+
+		if (child + 1 < idx->heap_len &&
+		    maint_heap_before(idx->heap[child + 1], idx->heap[child]))
+			child++;
 
+		if (!maint_heap_before(idx->heap[child], m))
+			break;
+
+		maint_heap_set(idx, i, idx->heap[child]);
+		i = child;
+	}
+	maint_heap_set(idx, i, m);
 }
 
-/* Criteria function for buffered packets based on sent ACK REQ */
-static inline int crit_ack_req_sent(void *pos, void *data)
+static void maint_heap_remove(struct maint_buf_idx *idx, struct maint_entry *m)
 {
-	struct maint_entry *m = (struct maint_entry *)pos;
+	unsigned int i = m->heap_idx;
+	struct maint_entry *last;
 
-	if (m->ack_req_sent)
-		return 1;
-	return 0;
+	last = idx->heap[--idx->heap_len];
+
+	if (i == idx->heap_len)
+		return;
+
+	maint_heap_set(idx, i, last);
+	maint_heap_up(idx, i);
+	maint_heap_down(idx, last->heap_idx);
+}
+
+/* Insert a packet in a next hop's list, keeping it ordered by ID */
+static void maint_neigh_insert(struct maint_neigh *nb, struct maint_entry *m)
+{
+	list_t *pos;
+
+	/* IDs increase with every ACK REQ, so the packet normally goes last.
+	 * They wrap around, and are compared as serial numbers. */
+	pos = nb->pkts.prev;
+
+	while (pos != &nb->pkts &&
+	       dsr_ack_id_after(list_entry(pos, struct maint_entry, nl)->id,
+				m->id))
+		pos = pos->prev;
+
+	list_add(&m->nl, pos);
+}
+
+/* Add a packet to the buffer and its indexes. The buffer must be write
+ * locked. */
+static int __maint_entry_add(struct tbl *t, struct maint_buf_idx *idx,
+			     struct maint_entry *m)
+{
+	struct maint_neigh *nb;
+
+	if (TBL_FULL(t) || idx->heap_len >= idx->heap_max)
+		return -ENOSPC;
+
+	nb = maint_neigh_find(idx, m->nxt_hop);
+
+	if (!nb) {
+		nb = (struct maint_neigh *)kmalloc(sizeof(struct maint_neigh),
+						   GFP_ATOMIC);
+		if (!nb)
+			return -ENOMEM;
+
+		nb->addr = m->nxt_hop;
+		nb->len = 0;
+		INIT_LIST_HEAD(&nb->pkts);
+		list_add(&nb->l, &idx->hash[maint_hash(m->nxt_hop)]);
+	}
+
+	__tbl_add_tail(t, &m->l);
+
+	maint_neigh_insert(nb, m);
+	m->neigh = nb;
+	nb->len++;
+
+	maint_heap_set(idx, idx->heap_len++, m);
+	maint_heap_up(idx, m->heap_idx);
+
+	return t->len;
+}
+
+/* Remove a packet from the buffer and its indexes. The buffer must be write
+ * locked. */
+static void __maint_entry_detach(struct tbl *t, struct maint_buf_idx *idx,
+				 struct maint_entry *m)
+{
+	struct maint_neigh *nb = m->neigh;
+
+	__tbl_detach(t, &m->l);
+	maint_heap_remove(idx, m);
+	list_del(&m->nl);
+
+	if (--nb->len == 0) {
+		list_del(&nb->l);
+		kfree(nb);
+	}
+	m->neigh = NULL;
+}
+
+/* Detach all packets buffered for a next hop, in ID order. The packets are
+ * put on the list "to", or freed if it is NULL. If "rtt" is given, it is set
+ * from packets that were not retransmitted. */
+static int __maint_buf_detach_neigh(struct tbl *t, struct maint_buf_idx *idx,
+				    struct in_addr nxt_hop, list_t *to,
+				    usecs_t *rtt)
+{
+	struct maint_neigh *nb;
+	struct timeval now;
+	unsigned int cnt;
+	int n = 0;
+
+	nb = maint_neigh_find(idx, nxt_hop);
+
+	if (!nb)
+		return 0;
+
+	gettime(&now);
+
+	/* The neighbor is freed together with its last packet */
+	for (cnt = nb->len; cnt > 0; cnt--) {
+		struct maint_entry *m;
+
+		m = list_entry(nb->pkts.next, struct maint_entry, nl);
+
+		if (rtt && m->rexmt == 0)
+			*rtt = timeval_diff(&now, &m->tx_time);
+
+		__maint_entry_detach(t, idx, m);
+
+		if (to)
+			list_add_tail(&m->l, to);
+		else {
+			maint_entry_free_pkt(m);
+			kfree(m);
+		}
+		n++;
+	}
+	return n;
 }
 
 void NSCLASS maint_buf_set_max_len(unsigned int max_len)
 {
+	write_lock_bh(&maint_buf.lock);
+
+	/* The heap only grows, so that it always fits the buffered packets */
+	if (max_len > maint_idx.heap_max) {
+		struct maint_entry **heap;
+
+		heap = (struct maint_entry **)
+			kmalloc(max_len * sizeof(struct maint_entry *),
+				GFP_ATOMIC);
+
+		if (!heap) {
+			LOG_DBG("Could not resize retransmission heap\n");
+			write_unlock_bh(&maint_buf.lock);
+			return;
+		}
+		memcpy(heap, maint_idx.heap,
+		       maint_idx.heap_len * sizeof(struct maint_entry *));
+		kfree(maint_idx.heap);
+
+		maint_idx.heap = heap;
+		maint_idx.heap_max = max_len;
+	}
 	maint_buf.max_len = max_len;
+
+	write_unlock_bh(&maint_buf.lock);
 }
 
 static struct maint_entry *maint_entry_create(struct dsr_pkt *dp,
@@ -170,18 +385,14 @@ static struct maint_entry *maint_entry_create(struct dsr_pkt *dp,
 	m->id = id;
 	m->rto = rto;
 	m->ack_req_sent = 0;
+	m->passive = 0;
+	m->neigh = NULL;
+	m->heap_idx = 0;
 #ifdef NS2
-	if (dp->p)
-		m->dp = dsr_pkt_alloc(dp->p->copy());
+	m->p = NULL;
 #else
-	m->dp = dsr_pkt_alloc(skb_copy(dp->skb, GFP_ATOMIC));
+	m->skb = NULL;
 #endif
-	if (!m->dp) {
-		kfree(m);
-		return NULL;
-	}
-	m->dp->nxt_hop = dp->nxt_hop;
-
 	return m;
 }
 
@@ -273,6 +484,11 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 
 	/* TODO: Check/set First and Last hop external bits */
 
+	if (dsr_pkt_opts_cow(dp) < 0) {
+		kfree(srt);
+		return -1;
+	}
+
 	old_srt_opt_len = dp->srt_opt->length + 2;
 	new_srt_opt_len = DSR_SRT_OPT_LEN(srt);
 	salv = dp->srt_opt->salv;
@@ -288,6 +504,7 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 					      salv + 1, srt);
 	} else {
 		int old_opt_len, new_opt_len;
+		int old_opt_size = dp->dh.end - dp->dh.raw;
 		char *old_opt = dp->dh.raw;
 		char *old_srt_opt = (char *)dp->srt_opt;
 		char *buf;
@@ -325,10 +542,17 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 		       old_opt + old_opt_len - 
 		       (old_srt_opt + old_srt_opt_len));
 
-		kfree(old_opt);	
+		dsr_opts_buf_free(old_opt, old_opt_size);
 		
 		/* Set new length in DSR header */
 		dp->dh.opth->p_len = htons(new_opt_len - DSR_OPT_HDR_LEN);
+#ifndef NS2
+		/* The IP header is that of the buffered packet, update its
+		 * length */
+		dsr_build_ip(dp, dp->src, dp->dst, dp->nh.iph->ihl << 2,
+			     (dp->nh.iph->ihl << 2) + new_opt_len +
+			     dp->payload_len, IPPROTO_DSR, dp->nh.iph->ttl);
+#endif
 	}
 
 	/* We got this packet directly from the previous hop */
@@ -349,105 +573,158 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 
 void NSCLASS maint_buf_timeout(unsigned long data)
 {
-        write_lock_bh(&maint_buf.lock);
-	_maint_buf_timeout(data);
-	write_unlock_bh(&maint_buf.lock);
-}
+	struct maint_entry *m;
+	struct timeval now;
+	list_t salvage, *pos, *tmp;
+	struct in_addr prev_hop;
+	struct maint_ack_req reqs[MAINT_ACK_REQ_BATCH];
+	int n = 0, first = 1, i, num_reqs = 0;
 
-void NSCLASS _maint_buf_timeout(unsigned long data)
-{
-	struct maint_entry *m, *m2;
+	INIT_LIST_HEAD(&salvage);
 
-	if (timer_pending(&ack_timer))
-		return;
+	write_lock_bh(&maint_buf.lock);
 
-	/* Get the first packet */
-	m = (struct maint_entry *)__tbl_detach_first(&maint_buf);
-		
-	if (!m) {
-		LOG_DBG("Nothing in maint buf\n");
-		return;
-	}
+	gettime(&now);
+
+	/* Handle all packets whose retransmission deadline has passed */
+	while (maint_idx.heap_len > 0) {
+		m = maint_idx.heap[0];
+
+		if (timeval_diff(&m->expires, &now) > 0)
+			break;
+
+		/* The rest are handled when the timer fires again, which
+		 * is immediately since they have already expired */
+		if (num_reqs == MAINT_ACK_REQ_BATCH)
+			break;
+
+		if (m->passive) {
+			struct neighbor *neigh;
+
+			/* The next hop was not overheard forwarding the
+			 * packet, fall back to an explicit ACK REQ */
+			m->passive = 0;
+
+			neigh = neigh_tbl_lookup(m->nxt_hop);
+
+			if (neigh) {
+				neigh_ack_req_claim(neigh, 0, &m->id);
+				m->rto = neigh_rto(neigh);
+				m->ack_req_sent = 1;
+				neigh_put(neigh);
+
+				list_del(&m->nl);
+				maint_neigh_insert(m->neigh, m);
+
+				reqs[num_reqs].nxt_hop = m->nxt_hop;
+				reqs[num_reqs++].id = m->id;
+				maint_stats.passive_fallbacks++;
+			}
+			m->tx_time = now;
+			m->expires = m->tx_time;
+			timeval_add_usecs(&m->expires, m->rto);
+
+			maint_heap_down(&maint_idx, m->heap_idx);
+			continue;
+		}
+
+		m->rexmt++;
+
+		LOG_DBG("nxt_hop=%s id=%u rexmt=%d\n",
+			print_ip(m->nxt_hop), m->id, m->rexmt);
 
-	m->rexmt++;
+		/* Increase the number of retransmits */
+		if (m->rexmt >= ConfVal(MaxMaintRexmt)) {
 
-	LOG_DBG("nxt_hop=%s id=%u rexmt=%d\n",
-                print_ip(m->nxt_hop), m->id, m->rexmt);
+			LOG_DBG("MaxMaintRexmt reached!\n");
 
-	/* Increase the number of retransmits */
-	if (m->rexmt >= ConfVal(MaxMaintRexmt)) {
+			if (m->ack_req_sent) {
+				/* The link is broken. Salvage this packet
+				 * first, then the others buffered for the same
+				 * next hop. */
+				__maint_entry_detach(&maint_buf, &maint_idx, m);
+				list_add_tail(&m->l, &salvage);
+				__maint_buf_detach_neigh(&maint_buf, &maint_idx,
+							 m->nxt_hop, &salvage,
+							 NULL);
+			} else {
+				LOG_DBG("No ACK REQ sent for this packet\n");
 
-		LOG_DBG("MaxMaintRexmt reached!\n");
+				__maint_entry_detach(&maint_buf, &maint_idx, m);
+#ifdef NS2
+				if (m->p) {
+					drop(m->p, DROP_RTR_SALVAGE);
+					m->p = NULL;
+				}
+#endif
+				maint_entry_free_pkt(m);
+				kfree(m);
+			}
+			continue;
+		}
 
+		/* Set new Transmit time */
+		m->tx_time = now;
+		m->expires = m->tx_time;
+		timeval_add_usecs(&m->expires, m->rto);
+
+		maint_heap_down(&maint_idx, m->heap_idx);
+
+		/* Send new ACK REQ for this buffered packet */
 		if (m->ack_req_sent) {
-			int n = 0;
+			reqs[num_reqs].nxt_hop = m->nxt_hop;
+			reqs[num_reqs++].id = m->id;
+		}
+	}
 
+	_maint_buf_set_timeout();
+
+	write_unlock_bh(&maint_buf.lock);
+
+	for (i = 0; i < num_reqs; i++)
+		dsr_ack_req_send(reqs[i].nxt_hop, reqs[i].id);
+
+	/* Salvaged packets are transmitted, and possibly buffered, again, so
+	 * this is done without holding the lock */
+	list_for_each_safe(pos, tmp, &salvage) {
+		struct dsr_pkt *dp;
+
+		m = (struct maint_entry *)pos;
+		list_del(&m->l);
+
+		dp = maint_entry_dsr_pkt(m);
+
+		if (first || m->nxt_hop.s_addr != prev_hop.s_addr) {
 			lc_link_del(my_addr(), m->nxt_hop);
 #ifdef NS2
 			/* Remove packets from interface queue */
 			Packet *qp;
-			
+
 			while ((qp = ifq_->prq_get_nexthop((nsaddr_t)m->nxt_hop.s_addr))) {
 				Packet::free(qp);
 			}
-#endif			
-			dsr_rerr_send(m->dp, m->nxt_hop);
+#endif
+			if (dp)
+				dsr_rerr_send(dp, m->nxt_hop);
+		}
+		first = 0;
+		prev_hop = m->nxt_hop;
 
-			/* Salvage timed out packet */
-			if (maint_buf_salvage(m->dp) < 0) {
+		if (dp) {
+			if (maint_buf_salvage(dp) < 0) {
 #ifdef NS2
-				if (m->dp->p) 
-					drop(m->dp->p, DROP_RTR_SALVAGE);
+				if (dp->p)
+					drop(dp->p, DROP_RTR_SALVAGE);
 #endif
-				dsr_pkt_free(m->dp);
+				dsr_pkt_free(dp);
 			} else
 				n++;
-			/* Salvage other packets in maintenance buffer with the
-			 * same next hop */
-			while ((m2 = (struct maint_entry *)__tbl_find_detach(&maint_buf, &m->nxt_hop, crit_addr))) {
-				
-				if (maint_buf_salvage(m2->dp) < 0) {
-#ifdef NS2
-					if (m2->dp->p)
-						drop(m2->dp->p, DROP_RTR_SALVAGE);
-#endif
-					dsr_pkt_free(m2->dp);
-				}
-				kfree(m2);
-				n++;
-			}
-			LOG_DBG("Salvaged %d packets from maint_buf\n", n);
-		} else {
-			LOG_DBG("No ACK REQ sent for this packet\n");
-
-			if (m->dp) {
-#ifdef NS2
-				if (m->dp->p)
-					drop(m->dp->p, DROP_RTR_SALVAGE);
-#endif
-				dsr_pkt_free(m->dp);
-			}			
-		}		
-		
+		}
+		maint_entry_free_pkt(m);
 		kfree(m);
-		goto out;
 	}
-
-	/* Set new Transmit time */
-	gettime(&m->tx_time);
-	m->expires = m->tx_time;
-	timeval_add_usecs(&m->expires, m->rto);
-
-	/* Send new ACK REQ for this buffered packet */
-	if (m->ack_req_sent)
-		dsr_ack_req_send(m->nxt_hop, m->id);
-
-	/* Add to maintenence buffer again */
-	__tbl_add(&maint_buf, &m->l, crit_expires);
-      out:
-	_maint_buf_set_timeout();
-
-	return;
+	if (!first)
+		LOG_DBG("Salvaged %d packets from maint_buf\n", n);
 }
 
 void NSCLASS maint_buf_set_timeout(void)
@@ -462,102 +739,126 @@ void NSCLASS maint_buf_set_timeout(void)
 void NSCLASS _maint_buf_set_timeout(void)
 {
 	struct maint_entry *m;
-	usecs_t rto;
-	struct timeval tx_time, now, expires;
+	struct timeval now;
 
-	if (tbl_empty(&maint_buf))
+	if (maint_idx.heap_len == 0) {
+		tw_timer_del(&ack_timer);
 		return;
+	}
 
 	gettime(&now);
 
-	/* Get first packet in maintenance buffer */
-	m = (struct maint_entry *)__tbl_find(&maint_buf, NULL,
-					     crit_ack_req_sent);
+	/* The earliest deadline is on top of the heap */
+	m = maint_idx.heap[0];
 
-	if (!m) {
-		LOG_DBG("No packet to set timeout for\n");
-		return;
-	}
+	LOG_DBG("ACK Timer: exp=%ld.%06ld now=%ld.%06ld\n",
+		m->expires.tv_sec, m->expires.tv_usec, now.tv_sec, now.tv_usec);
 
-	tx_time = m->tx_time;
-	rto = m->rto;
-	m->expires = tx_time;
-	timeval_add_usecs(&m->expires, m->rto);
-
-	expires = m->expires;
-
-	/* Check if this packet has already expired */
-	if (timeval_diff(&now, &tx_time) > (int)rto)
-		_maint_buf_timeout(0);
-	else {
-		LOG_DBG("ACK Timer: exp=%ld.%06ld now=%ld.%06ld\n",
-		      expires.tv_sec, expires.tv_usec, now.tv_sec, now.tv_usec);
-/* 		ack_timer.data = (unsigned long)m; */
-		set_timer(&ack_timer, &expires);
-	}
+	tw_timer_set(&ack_timer, &m->expires);
 }
 
-
-int NSCLASS maint_buf_add(struct dsr_pkt *dp)
+/* Prepare buffering of a packet that requests a network layer ACK. This has
+ * to be done before the packet is built, since an ACK REQ option may be
+ * added. The entry is then passed to maint_buf_add() together with the
+ * packet that was actually transmitted. */
+struct maint_entry *NSCLASS maint_buf_entry_create(struct dsr_pkt *dp,
+						   struct neighbor *neigh)
 {
-	struct neighbor_info neigh_info;
-	struct timeval now;
-	int res;
 	struct maint_entry *m;
 
        	if (!dp) {
 		LOG_DBG("dp is NULL!?\n");
-		return -1;
+		return NULL;
 	}
 
-	gettime(&now);
-
-	res = neigh_tbl_query(dp->nxt_hop, &neigh_info);
-
-	if (!res) {
+	if (!neigh) {
 		LOG_DBG("No neighbor info about %s\n", print_ip(dp->nxt_hop));
-		return -1;
+		return NULL;
 	}
 	
-	m = maint_entry_create(dp, neigh_info.id, neigh_info.rto);
+	m = maint_entry_create(dp, 0, neigh_rto(neigh));
 		
 	if (!m)
-		return -1;
+		return NULL;
+
+	/* If the next hop is going to forward the packet, try to overhear
+	 * that before asking for an explicit ACK */
+	if (ConfVal(TryPassiveAcks) && ConfVal(PromiscOperation) &&
+	    dp->srt_opt && dp->srt_opt->sleft > 0 &&
+	    dp->nxt_hop.s_addr != dp->dst.s_addr) {
+		m->passive = 1;
+		/* The ID is updated by neigh_ack_req_claim() */
+		spin_lock_bh(&neigh->lock);
+		m->id = neigh->id;
+		spin_unlock_bh(&neigh->lock);
+		m->src = dp->src;
+		m->dst = dp->dst;
+		m->pkt_id = maint_pkt_id(dp);
+		m->sleft = dp->srt_opt->sleft;
+		m->expires = m->tx_time;
+		timeval_add_usecs(&m->expires,
+				  ConfValToUsecs(PassiveAckTimeout));
+		return m;
+	}
 	
 	/* Check if we should add an ACK REQ */
-	if (dp->flags & PKT_REQUEST_ACK) {
-		if ((usecs_t) timeval_diff(&now, &neigh_info.last_ack_req) > 
-		    ConfValToUsecs(MaintHoldoffTime)) {
-			m->ack_req_sent = 1;
-			
-			/* Set last_ack_req time */
-			neigh_tbl_set_ack_req_time(m->nxt_hop);
+	if (neigh_ack_req_claim(neigh, ConfValToUsecs(MaintHoldoffTime),
+				&m->id)) {
+		m->ack_req_sent = 1;
 		
-			neigh_tbl_id_inc(m->nxt_hop);	
-			
-			dsr_ack_req_opt_add(dp, m->id);
-		}
-		
-		write_lock_bh(&maint_buf.lock);
+		dsr_ack_req_opt_add(dp, m->id);
+	} else {
+		LOG_DBG("Delaying ACK REQ for %s limit=%ld\n",
+                        print_ip(dp->nxt_hop), 
+                        ConfValToUsecs(MaintHoldoffTime));
+	}
+	return m;
+}
 
-		if (__tbl_add_tail(&maint_buf, &m->l) < 0) {
-			LOG_DBG("Buffer full - not buffering!\n");
-			dsr_pkt_free(m->dp);
+/* Buffer a transmitted packet until it is acknowledged. Rather than copying
+ * the packet, a reference to the already built transmit buffer is kept and
+ * it is only parsed again if the packet needs to be salvaged. The entry and
+ * the packet are both consumed. */
+#ifdef NS2
+int NSCLASS maint_buf_add(struct maint_entry *m, Packet *p)
+{
+	if (m)
+		m->p = p;
+	else if (p)
+		Packet::free(p);
+
+	if (!m || !p) {
+#else
+int NSCLASS maint_buf_add(struct maint_entry *m, struct sk_buff *skb)
+{
+	if (m)
+		m->skb = skb;
+	else if (skb)
+		dev_kfree_skb_any(skb);
+
+	if (!m || !skb) {
+#endif
+		LOG_DBG("Nothing to buffer\n");
+		if (m)
 			kfree(m);
-                        write_unlock_bh(&maint_buf.lock);
-			return -1;
-		}
-		
-		_maint_buf_set_timeout();
+		return -1;
+	}
+
+	write_lock_bh(&maint_buf.lock);
 
+	if (__maint_entry_add(&maint_buf, &maint_idx, m) < 0) {
+		LOG_DBG("Buffer full - not buffering!\n");
+		maint_entry_free_pkt(m);
+		kfree(m);
 		write_unlock_bh(&maint_buf.lock);
-	       
-	} else {
-		LOG_DBG("Delaying ACK REQ for %s since_last=%ld limit=%ld\n",
-                        print_ip(dp->nxt_hop), 
-                        timeval_diff(&now, &neigh_info.last_ack_req), 
-                        ConfValToUsecs(MaintHoldoffTime));
+		return -1;
 	}
+
+	/* Only re-arm the timer if this is now the earliest deadline */
+	if (m->heap_idx == 0)
+		_maint_buf_set_timeout();
+
+	write_unlock_bh(&maint_buf.lock);
 	
 	return 1;
 }
@@ -565,19 +866,12 @@ int NSCLASS maint_buf_add(struct dsr_pkt *dp)
 /* Remove all packets for a next hop */
 int NSCLASS maint_buf_del_all(struct in_addr nxt_hop)
 {
-	struct maint_buf_query q;
 	int n;
 
-	q.id = NULL;
-	q.nxt_hop = &nxt_hop;
-	q.rtt = 0;
-
 	write_lock_bh(&maint_buf.lock);
 	
-	if (timer_pending(&ack_timer))
-		del_timer_sync(&ack_timer);
-
-	n = __tbl_for_each_del(&maint_buf, &q, crit_addr_del);
+	n = __maint_buf_detach_neigh(&maint_buf, &maint_idx, nxt_hop, NULL,
+				     NULL);
 
 	_maint_buf_set_timeout();
 
@@ -588,57 +882,133 @@ int NSCLASS maint_buf_del_all(struct in_addr nxt_hop)
 /* Remove packets for a next hop with a specific ID */
 int NSCLASS maint_buf_del_all_id(struct in_addr nxt_hop, unsigned short id)
 {
-	struct maint_buf_query q;
-	int n;
-
-	q.id = &id;
-	q.nxt_hop = &nxt_hop;
-	q.rtt = 0;
+	struct maint_neigh *nb;
+	struct timeval now;
+	usecs_t rtt = 0;
+	unsigned int cnt;
+	int n = 0;
 
 	write_lock_bh(&maint_buf.lock);
 
-	if (timer_pending(&ack_timer))
-		del_timer_sync(&ack_timer);
+	nb = maint_neigh_find(&maint_idx, nxt_hop);
+
+	if (!nb)
+		goto out;
+
+	gettime(&now);
+
+	/* The ACK covers all packets up to this ID, which are first in the
+	 * next hop's list. The neighbor is freed with its last packet. */
+	for (cnt = nb->len; cnt > 0; cnt--) {
+		struct maint_entry *m;
+
+		m = list_entry(nb->pkts.next, struct maint_entry, nl);
+
+		if (dsr_ack_id_after(m->id, id))
+			break;
+
+		/* Only update RTO if this was not a retransmission */
+		if (m->id == id && m->rexmt == 0)
+			rtt = timeval_diff(&now, &m->tx_time);
 
-	/* Find the buffered packet to mark as acked */
-	n = __tbl_for_each_del(&maint_buf, &q, crit_addr_id_del);
+		__maint_entry_detach(&maint_buf, &maint_idx, m);
+		maint_entry_free_pkt(m);
+		kfree(m);
+		n++;
+	}
 	
-	if (q.rtt > 0) {
+	if (rtt > 0) {
 		struct neighbor_info neigh_info;
 		
 		neigh_info.id = id;
-		neigh_info.rtt = q.rtt;
+		neigh_info.rtt = rtt;
 		neigh_tbl_set_rto(nxt_hop, &neigh_info);
 	}
 
 	_maint_buf_set_timeout();
-
+      out:
 	write_unlock_bh(&maint_buf.lock);
 
 	return n;
 }
+
+/* Check if an overheard packet is one of our buffered packets being forwarded
+ * by the next hop, which acknowledges it passively */
+int NSCLASS maint_buf_passive_ack(struct dsr_pkt *dp)
+{
+	struct maint_neigh *nb;
+	struct in_addr from;
+	unsigned int pkt_id;
+	int n, sleft, res = 0;
+	list_t *pos;
+
+	if (!dp || !dp->srt_opt)
+		return 0;
+
+	/* Find the node that transmitted the overheard packet */
+	n = (dp->srt_opt->length - 2) / sizeof(struct in_addr);
+	sleft = dp->srt_opt->sleft;
+
+	if (sleft > n)
+		return 0;
+
+	if (sleft == n)
+		from = dp->src;
+	else
+		from.s_addr = dp->srt_opt->addrs[n - sleft - 1];
+
+	pkt_id = maint_pkt_id(dp);
+
+	write_lock_bh(&maint_buf.lock);
+
+	nb = maint_neigh_find(&maint_idx, from);
+
+	if (!nb)
+		goto out;
+
+	list_for_each(pos, &nb->pkts) {
+		struct maint_entry *m = list_entry(pos, struct maint_entry, nl);
+
+		if (!m->passive || m->pkt_id != pkt_id ||
+		    m->sleft != sleft + 1 ||
+		    m->src.s_addr != dp->src.s_addr ||
+		    m->dst.s_addr != dp->dst.s_addr)
+			continue;
+
+		LOG_DBG("Passive ACK from %s\n", print_ip(from));
+
+		__maint_entry_detach(&maint_buf, &maint_idx, m);
+		maint_entry_free_pkt(m);
+		kfree(m);
+
+		maint_stats.passive_acks++;
+		res = 1;
+
+		_maint_buf_set_timeout();
+		break;
+	}
+      out:
+	write_unlock_bh(&maint_buf.lock);
+
+	return res;
+}
+
 int NSCLASS maint_buf_del_addr(struct in_addr nxt_hop)
 {
-	struct maint_buf_query q;
+	usecs_t rtt = 0;
 	int n;
 
-	q.id = NULL;
-	q.nxt_hop = &nxt_hop;
-	q.rtt = 0;
-
         write_lock_bh(&maint_buf.lock);
 
-	if (timer_pending(&ack_timer))
-		del_timer_sync(&ack_timer);
-
-	/* Find the buffered packet to mark as acked */
-	n = __tbl_for_each_del(&maint_buf, &q, crit_addr_del);
+	/* Find the buffered packets to mark as acked */
+	n = __maint_buf_detach_neigh(&maint_buf, &maint_idx, nxt_hop, NULL,
+				     &rtt);
 	
-	if (q.rtt > 0) {
+	if (rtt > 0) {
 		struct neighbor_info neigh_info;
 		
 		neigh_info.id = 0;
-		neigh_info.rtt = q.rtt;
+		neigh_info.rtt = rtt;
 		neigh_tbl_set_rto(nxt_hop, &neigh_info);
 	}
 
@@ -666,7 +1036,7 @@ static int maint_buf_print(struct tbl *t, char *buffer)
 	list_for_each(p, &t->head) {
 		struct maint_entry *e = (struct maint_entry *)p;
 
-		if (e && e->dp)
+		if (e)
 			len +=
 			    sprintf(buffer + len,
 				    "  %-15s %-5d %-6u %-2d %-8u %-15s %-15s\n",
@@ -678,7 +1048,10 @@ static int maint_buf_print(struct tbl *t, char *buffer)
 
 	len += sprintf(buffer + len,
 		       "\nQueue length      : %u\n"
-		       "Queue max. length : %u\n", t->len, t->max_len);
+		       "Queue max. length : %u\n"
+		       "Passive ACKs      : %lu\n"
+		       "Passive fallbacks : %lu\n", t->len, t->max_len,
+		       maint_stats.passive_acks, maint_stats.passive_fallbacks);
 
 	read_unlock_bh(&t->lock);
 
@@ -706,8 +1079,26 @@ maint_buf_get_info(char *buffer, char **start, off_t offset, int length, int *eo
 
 int NSCLASS maint_buf_init(void)
 {
+	int i;
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
+#endif
+
+	for (i = 0; i < MAINT_BUF_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&maint_idx.hash[i]);
+
+	memset(&maint_stats, 0, sizeof(struct maint_buf_stats));
+
+	maint_idx.heap_len = 0;
+	maint_idx.heap_max = MAINT_BUF_MAX_LEN;
+	maint_idx.heap = (struct maint_entry **)
+		kmalloc(maint_idx.heap_max * sizeof(struct maint_entry *),
+			GFP_ATOMIC);
+
+	if (!maint_idx.heap)
+		return -ENOMEM;
+
+#ifdef __KERNEL__
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
 #define proc_net init_net.proc_net
 #endif
@@ -715,6 +1106,7 @@ int NSCLASS maint_buf_init(void)
 
 	if (!proc) {
 		printk(KERN_ERR "maint_buf: failed to create proc entry\n");
+		kfree(maint_idx.heap);
 		return -1;
 	}
 
@@ -724,10 +1116,7 @@ int NSCLASS maint_buf_init(void)
 #endif
 	INIT_TBL(&maint_buf, MAINT_BUF_MAX_LEN);
 
-	init_timer(&ack_timer);
-
-	ack_timer.function = &NSCLASS maint_buf_timeout;
-	ack_timer.expires = 0;
+	tw_timer_init(&ack_timer, &NSCLASS maint_buf_timeout, 0);
 
 	return 1;
 }
@@ -736,20 +1125,21 @@ void NSCLASS maint_buf_cleanup(void)
 {
 	struct maint_entry *m;
 
-	write_lock_bh(&maint_buf.lock);
-
-	del_timer_sync(&ack_timer);
+	tw_timer_del_sync(&ack_timer);
 
-	while ((m = (struct maint_entry *)__tbl_detach_first(&maint_buf))) {
-#ifdef NS2
-		if (m->dp->p)
-			Packet::free(m->dp->p);
-#endif
-		dsr_pkt_free(m->dp);
+	write_lock_bh(&maint_buf.lock);
 
+	while (maint_idx.heap_len > 0) {
+		m = maint_idx.heap[0];
+		__maint_entry_detach(&maint_buf, &maint_idx, m);
+		maint_entry_free_pkt(m);
 		kfree(m);
 	}
 
+	kfree(maint_idx.heap);
+	maint_idx.heap = NULL;
+	maint_idx.heap_max = 0;
+
 	write_unlock_bh(&maint_buf.lock);
 
 #ifdef __KERNEL__
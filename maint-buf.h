@@ -8,20 +8,51 @@
 #ifndef _MAINT_BUF_H
 #define _MAINT_BUF_H
 
+#include "tbl.h"
+
+#ifndef NO_GLOBALS
+
+#define MAINT_BUF_HASH_SIZE 32	/* Must be a power of two */
+
+struct maint_entry;
+struct neighbor;
+
+/* Index over the maintenance buffer. Packets are grouped per next hop in a
+ * hash table, and a min-heap orders them on retransmission deadline. */
+struct maint_buf_idx {
+	list_t hash[MAINT_BUF_HASH_SIZE];
+	struct maint_entry **heap;
+	unsigned int heap_len;
+	unsigned int heap_max;
+};
+
+struct maint_buf_stats {
+	unsigned long passive_acks;	/* Packets overheard being forwarded */
+	unsigned long passive_fallbacks; /* ACK REQs sent after timeout */
+};
+
+#endif				/* NO_GLOBALS */
+
 #ifndef NO_DECLS
 
 int maint_buf_init(void);
 void maint_buf_cleanup(void);
 
 void maint_buf_set_max_len(unsigned int max_len);
-int maint_buf_add(struct dsr_pkt *dp);
+struct maint_entry *maint_buf_entry_create(struct dsr_pkt *dp,
+					   struct neighbor *neigh);
+#ifdef NS2
+int maint_buf_add(struct maint_entry *m, Packet *p);
+#else
+int maint_buf_add(struct maint_entry *m, struct sk_buff *skb);
+#endif
 int maint_buf_del_all(struct in_addr nxt_hop);
 int maint_buf_del_all_id(struct in_addr nxt_hop, unsigned short id);
 int maint_buf_del_addr(struct in_addr nxt_hop);
+int maint_buf_passive_ack(struct dsr_pkt *dp);
 void maint_buf_set_timeout(void);
 void _maint_buf_set_timeout(void);
 void maint_buf_timeout(unsigned long data);
-void _maint_buf_timeout(unsigned long data);
 int maint_buf_salvage(struct dsr_pkt *dp);
 
 #endif				/* NO_DECLS */
@@ -18,16 +18,13 @@
 #include "neigh.h"
 #include "debug.h"
 #include "timer.h"
+#include "timer-wheel.h"
 
-#define NEIGH_TBL_MAX_LEN 50
-
-/* We calculate RTO in milliseconds */
-#define DSR_SRTTBASE 0
-#define DSR_SRTTDFLT 60
-#define DSR_MIN 20
-#define DSR_REXMTMAX 1280
-#define DSR_RTTDFLT 30
-#define PR_SLOWHZ 2
+/* We calculate RTO in microseconds. The smoothed RTT is scaled by 8 and the
+ * RTT variance by 4, as in TCP. */
+#define DSR_RTODFLT 60000
+#define DSR_MIN 2000
+#define DSR_REXMTMAX 1280000
 
 #define RTT_SHIFT 3
 #define RTTVAR_SHIFT 2
@@ -45,134 +42,138 @@
 #define VALMAX(a,b) ( a > b ? a : b)
 #define K 4
 
-#define DSR_REXMTVAL(val) \
-        (((val) >> RTT_SHIFT) + (val))
-
 #ifdef __KERNEL__
 static TBL(neigh_tbl, NEIGH_TBL_MAX_LEN);
+static list_t neigh_hash[NEIGH_TBL_HASH_SIZE];
 
 #define NEIGH_TBL_PROC_NAME "dsr_neigh_tbl"
 
-static DSRUUTimer neigh_tbl_timer;
+static struct tw_timer neigh_tbl_timer;
+static struct neigh_tbl_stats neigh_stats;
 #endif
 
+static inline unsigned int neigh_hash_idx(struct in_addr addr)
+{
+	unsigned int h = ntohl(addr.s_addr);
 
-struct neighbor {
-	list_t l;
-	struct in_addr addr;
-	struct sockaddr hw_addr;
-	unsigned short id;
-	struct timeval last_ack_req;
-	usecs_t t_srtt, rto, t_rxtcur, t_rttmin, t_rttvar, jitter;	/* RTT in usec */
-};
+	h ^= (h >> 16);
+	h ^= (h >> 8);
 
-struct neighbor_query {
-	struct in_addr *addr;
-	struct neighbor_info *info;
-};
+	return h & (NEIGH_TBL_HASH_SIZE - 1);
+}
 
-static inline int crit_addr(void *pos, void *query)
+/* Find a neighbor. The table must be locked. */
+static struct neighbor *__neigh_tbl_find(list_t *hash, struct in_addr addr)
 {
-	struct neighbor_query *q = (struct neighbor_query *)query;
-	struct neighbor *n = (struct neighbor *)pos;
-	usecs_t rto;
-
-	if (n->addr.s_addr == q->addr->s_addr) {
-		if (q->info) {
-			
-			q->info->id = n->id;
-			q->info->last_ack_req = n->last_ack_req;
-			memcpy(&q->info->hw_addr, &n->hw_addr,
-			       sizeof(struct sockaddr));
-			
-			rto = ConfValToUsecs(RoundTripTimeout);
-		
-			/* Return current RTO */
-			if (rto == 0) {
-				q->info->rto = n->t_rxtcur * 1000 / PR_SLOWHZ;
-			} else {
-				/* Fixed RTO (defaults to 2 secs) */
-				q->info->rto = rto;
-			}
-		}
-		return 1;
+	list_t *pos;
+
+	list_for_each(pos, &hash[neigh_hash_idx(addr)]) {
+		struct neighbor *neigh = list_entry(pos, struct neighbor, hl);
+
+		if (neigh->addr.s_addr == addr.s_addr)
+			return neigh;
 	}
-	return 0;
+	return NULL;
 }
 
-static inline int crit_addr_id_inc(void *pos, void *addr)
+static void rto_calc(struct neighbor *n, usecs_t rtt)
 {
-	struct in_addr *a = (struct in_addr *)addr;
-	struct neighbor *n = (struct neighbor *)pos;
+	long srtt = n->t_srtt, rttvar = n->t_rttvar, delta;
+
+	if (srtt != 0) {
+		delta = (long)rtt - (srtt >> RTT_SHIFT);
+
+		if ((srtt += delta) <= 0)
+			srtt = 1;
 
-	if (n->addr.s_addr == a->s_addr) {
-		n->id++;
-		//gettime(&n->last_ack_req);
-		return 1;
+		if (delta < 0)
+			delta = -delta;
+
+		delta -= (rttvar >> RTTVAR_SHIFT);
+
+		if ((rttvar += delta) <= 0)
+			rttvar = 1;
+	} else {
+		srtt = rtt << RTT_SHIFT;
+		rttvar = rtt << (RTTVAR_SHIFT - 1);
 	}
-	return 0;
+	n->t_srtt = srtt;
+	n->t_rttvar = rttvar;
+
+	/* RTO = SRTT + 4 * RTTVAR */
+	DSR_RANGESET(n->t_rxtcur, (srtt >> RTT_SHIFT) + rttvar,
+		     n->t_rttmin, DSR_REXMTMAX);
 }
-static inline int set_ack_req_time(void *pos, void *addr)
+
+/* Arm the garbage collection timer for when the least recently seen neighbor
+ * goes idle. The table must be locked. */
+void NSCLASS __neigh_tbl_set_timeout(void)
 {
-	struct in_addr *a = (struct in_addr *)addr;
-	struct neighbor *n = (struct neighbor *)pos;
+	struct neighbor *neigh;
+	struct timeval expires;
 
-	if (n->addr.s_addr == a->s_addr) {
-		gettime(&n->last_ack_req);
-		return 1;
+	if (TBL_EMPTY(&neigh_tbl)) {
+		tw_timer_del(&neigh_tbl_timer);
+		return;
 	}
-	return 0;
+
+	neigh = (struct neighbor *)TBL_FIRST(&neigh_tbl);
+
+	expires = neigh->last_seen;
+	timeval_add_usecs(&expires, NEIGH_TBL_TIMEOUT * 1000);
+
+	tw_timer_set(&neigh_tbl_timer, &expires);
 }
 
-static inline int rto_calc(void *pos, void *query)
+/* Remove a neighbor from the table. The table must be write locked, and the
+ * caller inherits the table's reference. */
+static void __neigh_tbl_unlink(struct tbl *t, struct neighbor *neigh)
 {
-	struct neighbor_query *q = (struct neighbor_query *)query;
-	struct neighbor *n = (struct neighbor *)pos;
-	
-	if (n->addr.s_addr == q->addr->s_addr) {
-		struct timeval now;
-		usecs_t rtt = q->info->rtt;
-		int delta;
-		
-		gettime(&now);
-		
-		/* Should verify for sure that this does the right
-		 * thing... */
-		if (n->t_srtt != 0) {
-			delta = rtt - 1 - (n->t_srtt >> RTT_SHIFT);
-			
-			if ((n->t_srtt += delta) <= 0)
-				n->t_srtt = 1;
-			
-			if (delta < 0)
-				delta = -delta;
-			
-			delta -= (n->t_rttvar >> RTTVAR_SHIFT);
-			
-			if ((n->t_rttvar += delta) <= 0)
-				n->t_rttvar = 1;
-		} else {
-			n->t_srtt = rtt << RTT_SHIFT;
-			n->t_rttvar = rtt << (RTTVAR_SHIFT - 1);
-		}
-		
-		DSR_RANGESET(n->t_rxtcur, DSR_REXMTVAL(n->t_srtt),
-			     n->t_rttmin, DSR_REXMTMAX);
-		
-		return 1;
-	}
-	return 0;
+	__tbl_detach(t, &neigh->l);
+	list_del(&neigh->hl);
 }
-/* TODO: Implement neighbor table garbage collection */
+
+/* Expire neighbors that have not been heard from for NEIGH_TBL_TIMEOUT. The
+ * table is kept in least recently seen order, so only its head needs to be
+ * checked. */
 void NSCLASS neigh_tbl_garbage_timeout(unsigned long data)
 {
-	/* tbl_for_each_del(&neigh_tbl, NULL, crit_garbage); */
+	struct timeval now;
+	list_t expired, *pos, *tmp;
+
+	INIT_LIST_HEAD(&expired);
+
+	gettime(&now);
+
+	write_lock_bh(&neigh_tbl.lock);
 
-/* 	if (!tbl_empty(&neigh_tbl)) { */
-	/*      garbage_timer.expires = TimeNow +  */
-/* 			MSECS_TO_TIMENOW(NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT); */
-	/*      add_timer(&garbage_timer);       */
-	/* } */
+	while (!TBL_EMPTY(&neigh_tbl)) {
+		struct neighbor *neigh = (struct neighbor *)TBL_FIRST(&neigh_tbl);
+
+		if (timeval_diff(&now, &neigh->last_seen) <
+		    NEIGH_TBL_TIMEOUT * 1000)
+			break;
+
+		__neigh_tbl_unlink(&neigh_tbl, neigh);
+		list_add_tail(&neigh->l, &expired);
+		neigh_stats.expired++;
+	}
+
+	__neigh_tbl_set_timeout();
+
+	write_unlock_bh(&neigh_tbl.lock);
+
+	/* Routes over the link are kept. If the link is used again before
+	 * the neighbor is heard from, dsr_dev_xmit() removes it. */
+	list_for_each_safe(pos, tmp, &expired) {
+		struct neighbor *neigh = (struct neighbor *)pos;
+
+		list_del(&neigh->l);
+
+		LOG_DBG("Neighbor %s expired\n", print_ip(neigh->addr));
+
+		neigh_put(neigh);
+	}
 }
 
 static struct neighbor *neigh_tbl_create(struct in_addr addr,
@@ -188,17 +189,20 @@ static struct neighbor *neigh_tbl_create(struct in_addr addr,
 
 	memset(neigh, 0, sizeof(struct neighbor));
 
+	/* The reference of the table */
+	atomic_set(&neigh->refcnt, 1);
+	spin_lock_init(&neigh->lock);
+
 	neigh->id = id;
 	neigh->addr = addr;
-	neigh->t_srtt = DSR_SRTTBASE;
-	neigh->t_rttvar = DSR_RTTDFLT * PR_SLOWHZ << 2;
+	neigh->t_srtt = 0;
+	neigh->t_rttvar = 0;
 	neigh->t_rttmin = DSR_MIN;
-	DSR_RANGESET(neigh->t_rxtcur, 
-		     ((DSR_SRTTBASE >> 2) + (DSR_SRTTDFLT << 2)) >> 1, 
-		     DSR_MIN, DSR_REXMTMAX);
+	neigh->t_rxtcur = DSR_RTODFLT;
 
 	memset(&neigh->last_ack_req, 0, sizeof(struct timeval));
 	memcpy(&neigh->hw_addr, hw_addr, sizeof(struct sockaddr));
+	gettime(&neigh->last_seen);
 
 /* 	garbage_timer.expires = TimeNow + NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT / 1000*HZ; */
 /* 	add_timer(&garbage_timer); */
@@ -213,13 +217,22 @@ int NSCLASS neigh_tbl_add(struct in_addr neigh_addr, struct ethhdr *ethh)
 #endif
 {
 	struct sockaddr hw_addr;
-	struct neighbor *neigh;
-	struct neighbor_query q;
+	struct neighbor *neigh, *evicted = NULL;
+	int res;
+
+	write_lock_bh(&neigh_tbl.lock);
 
-	q.addr = &neigh_addr;
-	q.info = NULL;
+	neigh = __neigh_tbl_find(neigh_hash, neigh_addr);
 
-	if (in_tbl(&neigh_tbl, &q, crit_addr))
+	/* Hearing from a known neighbor makes it the most recently seen */
+	if (neigh) {
+		gettime(&neigh->last_seen);
+		list_move_tail(&neigh->l, &neigh_tbl.head);
+	}
+
+	write_unlock_bh(&neigh_tbl.lock);
+
+	if (neigh)
 		return 0;
 #ifdef NS2
 	/* This should probably be changed to lookup the MAC type
@@ -241,51 +254,157 @@ int NSCLASS neigh_tbl_add(struct in_addr neigh_addr, struct ethhdr *ethh)
 
 	if (!neigh) {
 		LOG_DBG("Could not create new neighbor entry\n");
+		neigh_stats.refused++;
 		return -1;
 	}
-	tbl_add(&neigh_tbl, &neigh->l, crit_none);
 
-	return 1;
+	write_lock_bh(&neigh_tbl.lock);
+
+	/* Someone may have added it while the table was unlocked */
+	if (__neigh_tbl_find(neigh_hash, neigh_addr)) {
+		res = 0;
+		goto out;
+	}
+
+	/* Make room by evicting the least recently seen neighbor */
+	if (TBL_FULL(&neigh_tbl) && !TBL_EMPTY(&neigh_tbl)) {
+		evicted = (struct neighbor *)TBL_FIRST(&neigh_tbl);
+		__neigh_tbl_unlink(&neigh_tbl, evicted);
+		neigh_stats.evicted++;
+	}
+
+	if (__tbl_add_tail(&neigh_tbl, &neigh->l) < 0) {
+		LOG_DBG("Neighbor table full, %s not added\n",
+			print_ip(neigh_addr));
+		neigh_stats.refused++;
+		res = -1;
+		goto out;
+	}
+
+	list_add(&neigh->hl, &neigh_hash[neigh_hash_idx(neigh_addr)]);
+
+	if (neigh_tbl.len == 1)
+		__neigh_tbl_set_timeout();
+
+	neigh = NULL;
+	res = 1;
+      out:
+	write_unlock_bh(&neigh_tbl.lock);
+
+	if (neigh)
+		kfree(neigh);
+
+	if (evicted)
+		neigh_put(evicted);
+
+	return res;
 }
 
 int NSCLASS neigh_tbl_del(struct in_addr neigh_addr)
 {
-	return tbl_for_each_del(&neigh_tbl, &neigh_addr, crit_addr);
+	struct neighbor *neigh;
+
+	write_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_hash, neigh_addr);
+
+	if (neigh)
+		__neigh_tbl_unlink(&neigh_tbl, neigh);
+
+	write_unlock_bh(&neigh_tbl.lock);
+
+	if (!neigh)
+		return 0;
+
+	neigh_put(neigh);
+
+	return 1;
 }
 
-int NSCLASS neigh_tbl_set_ack_req_time(struct in_addr neigh_addr)
+/* Look up a neighbor, returning it with a reference held */
+struct neighbor *NSCLASS neigh_tbl_lookup(struct in_addr neigh_addr)
 {
-	return tbl_find_do(&neigh_tbl, &neigh_addr, set_ack_req_time);
+	struct neighbor *neigh;
+
+	read_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_hash, neigh_addr);
+
+	if (neigh)
+		atomic_inc(&neigh->refcnt);
+
+	read_unlock_bh(&neigh_tbl.lock);
+
+	return neigh;
 }
 
-int NSCLASS 
-neigh_tbl_set_rto(struct in_addr neigh_addr, struct neighbor_info *neigh_info)
+usecs_t NSCLASS neigh_rto(struct neighbor *neigh)
 {
-	struct neighbor_query q;
-	
-	q.addr = &neigh_addr;
-	q.info = neigh_info;
-	
-	return tbl_find_do(&neigh_tbl, &q, rto_calc);
+	usecs_t rto = ConfValToUsecs(RoundTripTimeout);
+
+	/* Fixed RTO (defaults to 2 secs) */
+	if (rto)
+		return rto;
+
+	/* Return current RTO */
+	return neigh->t_rxtcur;
 }
 
-int NSCLASS
-neigh_tbl_query(struct in_addr neigh_addr, struct neighbor_info *neigh_info)
+/* Claim an ID for an ACK REQ to a neighbor, unless one was sent less than
+ * holdoff usecs ago (a holdoff of 0 always claims one). Returns 1 if an ID was
+ * claimed. Either way, id is set to the ID that the next ACK from the neighbor
+ * will cover. */
+int NSCLASS neigh_ack_req_claim(struct neighbor *neigh, usecs_t holdoff,
+				unsigned short *id)
 {
-	struct neighbor_query q;
+	struct timeval now;
+	int res = 0;
 
-	q.addr = &neigh_addr;
-	q.info = neigh_info;
+	gettime(&now);
 
-	return in_tbl(&neigh_tbl, &q, crit_addr);
+	spin_lock_bh(&neigh->lock);
+
+	if (holdoff == 0 ||
+	    (usecs_t) timeval_diff(&now, &neigh->last_ack_req) > holdoff) {
+		neigh->last_ack_req = now;
+		*id = neigh->id++;
+		res = 1;
+	} else
+		*id = neigh->id;
+
+	spin_unlock_bh(&neigh->lock);
+
+	return res;
 }
 
-int NSCLASS neigh_tbl_id_inc(struct in_addr neigh_addr)
+int NSCLASS 
+neigh_tbl_set_rto(struct in_addr neigh_addr, struct neighbor_info *neigh_info)
 {
-	return tbl_find_do(&neigh_tbl, &neigh_addr, crit_addr_id_inc);
+	struct neighbor *neigh;
+
+	write_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_hash, neigh_addr);
+
+	if (neigh) {
+		/* An ACK shows that the neighbor is still there */
+		gettime(&neigh->last_seen);
+		list_move_tail(&neigh->l, &neigh_tbl.head);
+
+		spin_lock_bh(&neigh->lock);
+		rto_calc(neigh, neigh_info->rtt);
+		spin_unlock_bh(&neigh->lock);
+	}
+
+	write_unlock_bh(&neigh_tbl.lock);
+
+	return neigh ? 1 : 0;
 }
 
 #ifdef __KERNEL__
+/* Room kept for the counters at the end of the proc output */
+#define NEIGH_TBL_PRINT_TAIL 256
+
 static int neigh_tbl_print(char *buf)
 {
 	list_t *pos;
@@ -299,13 +418,32 @@ static int neigh_tbl_print(char *buf)
 
 	list_for_each(pos, &neigh_tbl.head) {
 		struct neighbor *neigh = (struct neighbor *)pos;
+		int n;
 
-		len += sprintf(buf + len, "  %-15s %-17s %-10lu %-6u\n",
-			       print_ip(neigh->addr),
-			       print_eth(neigh->hw_addr.sa_data),
-			       neigh->t_rxtcur, neigh->id);
+		n = snprintf(buf + len, PAGE_SIZE - len,
+			     "  %-15s %-17s %-10lu %-6u\n",
+			     print_ip(neigh->addr),
+			     print_eth(neigh->hw_addr.sa_data),
+			     neigh->t_rxtcur, neigh->id);
+
+		/* The proc buffer is one page. With a large table, the
+		 * neighbors that do not fit before the counters are left
+		 * out. */
+		if (len + n >= PAGE_SIZE - NEIGH_TBL_PRINT_TAIL)
+			break;
+
+		len += n;
 	}
 
+	len += snprintf(buf + len, PAGE_SIZE - len,
+			"\nTable length      : %u\n"
+			"Table max. length : %u\n"
+			"Expired           : %lu\n"
+			"Evicted           : %lu\n"
+			"Refused           : %lu\n",
+			neigh_tbl.len, neigh_tbl.max_len, neigh_stats.expired,
+			neigh_stats.evicted, neigh_stats.refused);
+
 	read_unlock_bh(&neigh_tbl.lock);
 	return len;
 }
@@ -330,6 +468,7 @@ neigh_tbl_proc_info(char *buffer, char **start, off_t offset, int length, int *e
 
 int __init NSCLASS neigh_tbl_init(void)
 {
+	int i;
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
@@ -340,18 +479,39 @@ int __init NSCLASS neigh_tbl_init(void)
 	if (!proc)
 		return -1;
 #endif
-	INIT_TBL(&neigh_tbl, NEIGH_TBL_MAX_LEN);
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&neigh_hash[i]);
+
+	INIT_TBL(&neigh_tbl, ConfVal(NeighborTableSize));
 
-	init_timer(&neigh_tbl_timer);
+	memset(&neigh_stats, 0, sizeof(struct neigh_tbl_stats));
 
-	neigh_tbl_timer.function = &NSCLASS neigh_tbl_garbage_timeout;
+	tw_timer_init(&neigh_tbl_timer, &NSCLASS neigh_tbl_garbage_timeout, 0);
 
 	return 0;
 }
 
-void __exit NSCLASS neigh_tbl_cleanup(void)
+void NSCLASS neigh_tbl_set_max_len(unsigned int max_len)
+{
+	write_lock_bh(&neigh_tbl.lock);
+	neigh_tbl.max_len = max_len;
+	write_unlock_bh(&neigh_tbl.lock);
+}
+
+void NSCLASS neigh_tbl_cleanup(void)
 {
-	tbl_flush(&neigh_tbl, crit_none);
+	struct neighbor *neigh;
+
+	tw_timer_del_sync(&neigh_tbl_timer);
+
+	write_lock_bh(&neigh_tbl.lock);
+
+	while ((neigh = (struct neighbor *)__tbl_detach_first(&neigh_tbl))) {
+		list_del(&neigh->hl);
+		neigh_put(neigh);
+	}
+
+	write_unlock_bh(&neigh_tbl.lock);
 
 #ifdef __KERNEL__
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
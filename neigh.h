@@ -10,12 +10,18 @@
 
 #ifdef __KERNEL__
 #include <linux/if_ether.h>
+#include <asm/atomic.h>
+#else
+#include "atomic.h"
 #endif
 
 #include "dsr.h"
+#include "tbl.h"
 
 #ifndef NO_GLOBALS
 
+#define NEIGH_TBL_HASH_SIZE 32	/* Must be a power of two */
+
 struct neighbor_info {
 	struct sockaddr hw_addr;
 	unsigned short id;
@@ -23,6 +29,39 @@ struct neighbor_info {
 	struct timeval last_ack_req;
 };
 
+/* A neighbor table entry. Entries returned by neigh_tbl_lookup() hold a
+ * reference that is released with neigh_put(). */
+struct neighbor {
+	list_t l;
+	list_t hl;		/* Hash chain */
+	atomic_t refcnt;
+	spinlock_t lock;	/* Protects ID, ACK REQ time and RTT state */
+	struct in_addr addr;
+	struct sockaddr hw_addr;
+	unsigned short id;
+	struct timeval last_ack_req;
+	struct timeval last_seen;	/* Last heard from */
+	usecs_t t_srtt, rto, t_rxtcur, t_rttmin, t_rttvar, jitter;	/* RTT in usec */
+#ifdef __KERNEL__
+	/* Prebuilt Ethernet header for the slave device with index
+	 * hh_ifindex, see dsr_hw_header_create(). Protected by lock. */
+	int hh_ifindex;
+	struct ethhdr hh;
+#endif
+};
+
+struct neigh_tbl_stats {
+	unsigned long expired;	/* Removed after being idle */
+	unsigned long evicted;	/* Removed to make room for a new neighbor */
+	unsigned long refused;	/* New neighbors that could not be added */
+};
+
+static inline void neigh_put(struct neighbor *neigh)
+{
+	if (atomic_dec_and_test(&neigh->refcnt))
+		kfree(neigh);
+}
+
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
@@ -32,12 +71,14 @@ int neigh_tbl_add(struct in_addr neigh_addr, struct hdr_mac *mac);
 int neigh_tbl_add(struct in_addr neigh_addr, struct ethhdr *ethh);
 #endif
 int neigh_tbl_del(struct in_addr neigh_addr);
-int neigh_tbl_query(struct in_addr neigh_addr,
-		    struct neighbor_info *neigh_info);
-int neigh_tbl_id_inc(struct in_addr neigh_addr);
+struct neighbor *neigh_tbl_lookup(struct in_addr neigh_addr);
+usecs_t neigh_rto(struct neighbor *neigh);
+int neigh_ack_req_claim(struct neighbor *neigh, usecs_t holdoff,
+			unsigned short *id);
 int neigh_tbl_set_rto(struct in_addr neigh_addr, struct neighbor_info *neigh_info);
-int neigh_tbl_set_ack_req_time(struct in_addr neigh_addr);
+void __neigh_tbl_set_timeout(void);
 void neigh_tbl_garbage_timeout(unsigned long data);
+void neigh_tbl_set_max_len(unsigned int max_len);
 
 int neigh_tbl_init(void);
 void neigh_tbl_cleanup(void);
@@ -1369,4 +1369,18 @@ Agent/DSRUU set TryPassiveAcks_ 1
 Agent/DSRUU set PassiveAckTimeout_ 100
 Agent/DSRUU set GratReplyHoldOff_ 1
 Agent/DSRUU set MAX_SALVAGE_COUNT_ 15
+Agent/DSRUU set UnreachableHoldoff_ 10
+Agent/DSRUU set MaxUnreachableHoldoff_ 300
+Agent/DSRUU set AckAggregationDelay_ 10
+Agent/DSRUU set NeighborTableSize_ 50
+Agent/DSRUU set NetworkDiameter_ 16
+Agent/DSRUU set SeedRequestTTL_ 1
+Agent/DSRUU set RequestForwardDelay_ 10
+Agent/DSRUU set RequestDuplicateThreshold_ 3
+Agent/DSRUU set RequestForwardProbability_ 100
+Agent/DSRUU set RequestRateLimit_ 20
+Agent/DSRUU set RequestRateBurst_ 10
+Agent/DSRUU set TargetRequestInterval_ 500
+Agent/DSRUU set TargetRequestBurst_ 4
+Agent/DSRUU set RequestCoalesceDelay_ 0
 
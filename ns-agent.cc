@@ -34,11 +34,8 @@ public:
 int DSRUU::confvals[CONFVAL_MAX];
 
 DSRUU::DSRUU() : Agent(PT_DSR), 
-		 ack_timer(this, "ACKTimer"), 
-		 grat_rrep_tbl_timer(this, "GratRREPTimer"), 
-		 send_buf_timer(this, "SendBufTimer"), 
-		 neigh_tbl_timer(this, "NeighTblTimer"), 
-		 lc_timer(this, "LinkCacheTimer")
+		 lc_timer(this, "LinkCacheTimer"),
+		 tw_driver(this, "TimerWheel")
 {
 	int i;
 	
@@ -64,11 +61,13 @@ DSRUU::DSRUU() : Agent(PT_DSR),
 	set_confval(PrintDebug, 1);
 	
 	/* Initilize tables */
+	timer_wheel_init();
 	lc_init();
 	neigh_tbl_init();
 	rreq_tbl_init();
 	grat_rrep_tbl_init();
 	maint_buf_init();
+	ack_tbl_init();
 	send_buf_init();
 	
 	myaddr_.s_addr = 0;
@@ -84,6 +83,8 @@ DSRUU::~DSRUU()
 	grat_rrep_tbl_cleanup();
 	send_buf_cleanup();
  	maint_buf_cleanup();
+	ack_tbl_cleanup();
+	timer_wheel_cleanup();
 
 	exit(-1);
 }
@@ -245,7 +246,7 @@ struct hdr_ip *DSRUU::dsr_build_ip(struct dsr_pkt *dp, struct in_addr src,
 	return dp->nh.iph;
 }
 
-Packet *DSRUU::ns_packet_create(struct dsr_pkt *dp)
+Packet *DSRUU::ns_packet_create(struct dsr_pkt *dp, struct neighbor *neigh)
 {
 	hdr_mac *mh;
 	hdr_cmn *cmh;
@@ -267,16 +268,15 @@ Packet *DSRUU::ns_packet_create(struct dsr_pkt *dp)
 	if (dp->dst.s_addr == DSR_BROADCAST) {
 		cmh->addr_type() = NS_AF_NONE;
 	} else {
-		struct neighbor_info neigh_info;
 		int mac_dst;
 		
-		if (!neigh_tbl_query(dp->nxt_hop, &neigh_info)) {
+		if (!neigh) {
 			DEBUG("No next hop MAC address in neigh_tbl\n");
 			Packet::free(dp->p);
 			return NULL;
 		}
 
-		ethtoint((char *)&neigh_info.hw_addr, &mac_dst);
+		ethtoint((char *)&neigh->hw_addr, &mac_dst);
 
 		/* Broadcast packet */
 		mac_->hdr_dst((char*) HDR_MAC(dp->p), mac_dst);
@@ -321,12 +321,24 @@ void DSRUU::ns_xmit(struct dsr_pkt *dp)
 	
 	struct hdr_cmn *cmh;
 	struct hdr_ip *iph; 
+	struct maint_entry *m = NULL;
+	struct neighbor *neigh = NULL;
 	double jitter = 0;
 
+	if (dp->dst.s_addr != DSR_BROADCAST) {
+		neigh = neigh_tbl_lookup(dp->nxt_hop);
+
+		/* See dsr_dev_xmit() */
+		if (!neigh)
+			lc_link_del(my_addr(), dp->nxt_hop);
+	}
+
+	dsr_ack_piggyback(dp);
+
  	if (dp->flags & PKT_REQUEST_ACK)	
- 		maint_buf_add(dp);
+ 		m = maint_buf_entry_create(dp, neigh);
 	
-	p = ns_packet_create(dp);
+	p = ns_packet_create(dp, neigh);
 
 	if (!p) {
 		DEBUG("Could not create packet\n");
@@ -362,8 +374,22 @@ void DSRUU::ns_xmit(struct dsr_pkt *dp)
 	}
 	if ( Random::uniform() > 0.6)
 		jitter = 1;
+
+	/* Buffer a copy of the built packet for retransmission and
+	 * salvaging */
+	if (m) {
+		maint_buf_add(m, p->copy());
+		m = NULL;
+	}
+
 	Scheduler::instance().schedule(ll_, p, jitter);
  out:
+	if (m)
+		maint_buf_add(m, NULL);
+
+	if (neigh)
+		neigh_put(neigh);
+
 	dp->p = NULL;
 
 	dsr_pkt_free(dp);
@@ -433,8 +459,10 @@ void DSRUU::tap(const Packet *p_in)
 	/* Cast the packet so that we can touch it */
 	Packet *p = (Packet *)p_in;
 
-	/* Do nothing for my own packets... */
-	if ((unsigned int)iph->saddr() == myaddr_.s_addr)
+	/* Do nothing for my own packets, unless the next hop forwarding them
+	 * may serve as a passive ACK */
+	if ((unsigned int)iph->saddr() == myaddr_.s_addr &&
+	    !ConfVal(TryPassiveAcks))
 		return;
 
 	next_hop.s_addr = cmh->next_hop_;
@@ -462,13 +490,8 @@ void DSRUU::tap(const Packet *p_in)
 
 	switch(cmh->ptype()) {
 	case PT_DSR:
-		if (dp->src.s_addr != myaddr_.s_addr) {
-			//DEBUG("DSR packet from %s\n", print_ip(dp->src));
-			dsr_recv(dp);
-		} else {
-// 			DEBUG("Locally gernerated DSR packet\n");
-			dsr_pkt_free(dp);
-		}
+		/* My own packets are only checked for passive ACKs */
+		dsr_recv(dp);
 		break;
 	default:
 		// This shouldn't really happen ?
@@ -490,6 +513,7 @@ enum {
 	SET_DMUX,
 	SET_TRACE_TARGET,
 	START_DSR,
+	DUMP_RREQ_STATS,
 	MAX_CMD
 };
 
@@ -501,7 +525,8 @@ char *cmd[MAX_CMD] = {
 	"install-tap",
 	"port-dmux",
 	"tracetarget",
-	"startdsr"
+	"startdsr",
+	"dump-rreq-stats"
 };
 
 static int name2cmd(const char *name)
@@ -546,6 +571,13 @@ int DSRUU::command(int argc, const char* const* argv)
 		break;
 	case START_DSR:
 		break;
+	case DUMP_RREQ_STATS: {
+		char buf[1024];
+
+		rreq_tbl_stats_print(buf);
+		printf("RREQ stats for %s:%s", print_ip(myaddr_), buf);
+		break;
+	}
 	default:
 		//cerr << "Unknown command " << argv[1] << endl;
 		return Agent::command(argc, argv);
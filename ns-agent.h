@@ -48,6 +48,8 @@ class DSRUU;
 #include "dsr-srt.h"
 #include "neigh.h"
 #include "link-cache.h"
+#include "maint-buf.h"
+#include "timer-wheel.h"
 #undef NO_DECLS
 
 typedef dsr_opt_hdr hdr_dsruu;
@@ -56,6 +58,11 @@ typedef dsr_opt_hdr hdr_dsruu;
 #define init_timer(timer)
 #define timer_pending(timer) ((timer)->status() == TIMER_PENDING)
 #define del_timer_sync(timer) del_timer(timer)
+#define hr_timer_init(timer) init_timer(timer)
+#define hr_timer_pending(timer) timer_pending(timer)
+#define hr_timer_del(timer) del_timer(timer)
+#define hr_timer_del_sync(timer) del_timer_sync(timer)
+#define set_hr_timer(timer, expires) set_timer(timer, expires)
 #define MALLOC(s, p) malloc(s)
 #define FREE(p) free(p)
 #define XMIT(pkt) ns_xmit(pkt)
@@ -80,12 +87,11 @@ class DSRUU:public Tap, public Agent {
 	DSRUU();
 	~DSRUU();
 
-	DSRUUTimer ack_timer;
 
 	int command(int argc, const char *const *argv);
 	void recv(Packet *, Handler * callback = 0);
 	void tap(const Packet * p);
-	Packet *ns_packet_create(struct dsr_pkt *dp);
+	Packet *ns_packet_create(struct dsr_pkt *dp, struct neighbor *neigh);
 	void ns_xmit(struct dsr_pkt *dp);
 	void ns_deliver(struct dsr_pkt *dp);
 	void xmit_failed(Packet *p);
@@ -160,6 +166,9 @@ class DSRUU:public Tap, public Agent {
 #undef _LINK_CACHE_H
 #include "link-cache.h"
 
+#undef _TIMER_WHEEL_H
+#include "timer-wheel.h"
+
 #undef _DEBUG_H
 #include "debug.h"
 
@@ -188,18 +197,35 @@ class DSRUU:public Tap, public Agent {
 	MobileNode *node_;
 
 	struct tbl rreq_tbl;
+	struct tbl rreq_fwd_q;
+	list_t rreq_hash[RREQ_TBL_HASH_SIZE];
 	struct tbl grat_rrep_tbl;
 	struct tbl send_buf;
 	struct tbl neigh_tbl;
+	list_t neigh_hash[NEIGH_TBL_HASH_SIZE];
 	struct tbl maint_buf;
+	struct tbl ack_tbl;
+	struct maint_buf_idx maint_idx;
+	struct maint_buf_stats maint_stats;
 
 	unsigned int rreq_seqno;
-
-	DSRUUTimer grat_rrep_tbl_timer;
-	DSRUUTimer send_buf_timer;
-	DSRUUTimer neigh_tbl_timer;
+	struct rreq_tbl_stats rreq_stats;
+	struct rreq_bucket rreq_bucket;
+	struct ack_tbl_stats ack_stats;
+	struct neigh_tbl_stats neigh_stats;
+
+	struct tw_timer ack_timer;
+	struct tw_timer rreq_coalesce_timer;
+	struct tw_timer grat_rrep_tbl_timer;
+	struct tw_timer send_buf_timer;
+	struct tw_timer neigh_tbl_timer;
+	struct tw_timer ack_tbl_timer;
 	DSRUUTimer lc_timer;
 
+	/* The timer wheel and its driver */
+	struct timer_wheel tw;
+	DSRUUHrTimer tw_driver;
+
 	/* The link cache */
 	struct lc_graph LC;
 };
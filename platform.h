@@ -17,7 +17,14 @@
 #include <linux/version.h>
 #else
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
 #include "list.h"
 
 #define kmalloc(sz, alloc) malloc(sz)
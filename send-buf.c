@@ -31,12 +31,13 @@
 #include "link-cache.h"
 #include "dsr-srt.h"
 #include "timer.h"
+#include "timer-wheel.h"
 
 #ifdef __KERNEL__
 #define SEND_BUF_PROC_FS_NAME "send_buf"
 
 TBL(send_buf, SEND_BUF_MAX_LEN);
-static DSRUUTimer send_buf_timer;
+static struct tw_timer send_buf_timer;
 static int send_buf_print(struct tbl *t, char *buffer);
 #endif
 
@@ -114,7 +115,7 @@ void NSCLASS send_buf_timeout(unsigned long data)
         
 	read_unlock_bh(&send_buf.lock);
 
-	set_timer(&send_buf_timer, &expires);
+	tw_timer_set(&send_buf_timer, &expires);
 }
 
 static struct send_buf_entry *send_buf_entry_create(struct dsr_pkt *dp,
@@ -180,12 +181,23 @@ int NSCLASS send_buf_enqueue_packet(struct dsr_pkt *dp, xmit_fct_t okfn)
 	if (empty) {
 		gettime(&expires);
 		timeval_add_usecs(&expires, ConfValToUsecs(SendBufferTimeout));
-		set_timer(&send_buf_timer, &expires);
+		tw_timer_set(&send_buf_timer, &expires);
 	}
 
 	return res;
 }
 
+/* Free a packet that cannot be delivered, optionally notifying the sender
+ * with an ICMP host unreachable message. */
+void NSCLASS send_buf_drop_pkt(struct dsr_pkt *dp, int send_icmp)
+{
+#ifdef __KERNEL__
+	if (send_icmp && dp->skb)
+		icmp_send(dp->skb, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, 0);
+#endif
+	dsr_pkt_free(dp);
+}
+
 int NSCLASS send_buf_set_verdict(int verdict, struct in_addr dst)
 {
 	struct send_buf_entry *e;
@@ -201,12 +213,7 @@ int NSCLASS send_buf_set_verdict(int verdict, struct in_addr dst)
 								   &dst,
 								   crit_addr))) {
 			/* Only send one ICMP message */
-#ifdef __KERNEL__
-			if (pkts == 0)
-				icmp_send(e->dp->skb, ICMP_DEST_UNREACH,
-					  ICMP_HOST_UNREACH, 0);
-#endif
-			dsr_pkt_free(e->dp);
+			send_buf_drop_pkt(e->dp, pkts == 0);
 			kfree(e);
 			pkts++;
 		}
@@ -345,21 +352,18 @@ int __init NSCLASS send_buf_init(void)
 #endif
 	INIT_TBL(&send_buf, SEND_BUF_MAX_LEN);
 
-	init_timer(&send_buf_timer);
-
-	send_buf_timer.function = &NSCLASS send_buf_timeout;
+	tw_timer_init(&send_buf_timer, &NSCLASS send_buf_timeout, 0);
 
 	return 1;
 }
 
-void __exit NSCLASS send_buf_cleanup(void)
+void NSCLASS send_buf_cleanup(void)
 {
 	int pkts;
 #ifdef KERNEL26
 	synchronize_net();
 #endif
-	if (timer_pending(&send_buf_timer))
-		del_timer_sync(&send_buf_timer);
+	tw_timer_del_sync(&send_buf_timer);
 
 	pkts = send_buf_flush(&send_buf);
 
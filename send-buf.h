@@ -30,6 +30,7 @@ void send_buf_set_max_len(unsigned int max_len);
 int send_buf_find(struct in_addr dst);
 int send_buf_enqueue_packet(struct dsr_pkt *dp, xmit_fct_t okfn);
 int send_buf_set_verdict(int verdict, struct in_addr dst);
+void send_buf_drop_pkt(struct dsr_pkt *dp, int send_icmp);
 int send_buf_init(void);
 void send_buf_cleanup(void);
 void send_buf_timeout(unsigned long data);
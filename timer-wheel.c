@@ -0,0 +1,284 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/* Copyright (C) Uppsala University
+ *
+ * This file is distributed under the terms of the GNU general Public
+ * License (GPL), see the file LICENSE
+ *
+ * Author: Erik Nordström, <erikn@it.uu.se>
+ */
+#ifdef __KERNEL__
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#endif
+
+#ifdef NS2
+#include "ns-agent.h"
+#endif
+
+#include "debug.h"
+#include "timer.h"
+#include "timer-wheel.h"
+
+/* All timeouts of the protocol are kept on one hierarchical timing wheel,
+ * driven by a single timer that is only armed for the next tick that has
+ * work to do. Arming and cancelling a timer are O(1). */
+
+#ifdef __KERNEL__
+static struct timer_wheel tw;
+static DSRUUHrTimer tw_driver;
+#endif
+
+/* Convert a time to a tick, rounding up so that no timer runs early, or
+ * down for the current time. */
+static unsigned long tw_tick(struct timer_wheel *w, struct timeval *tv,
+			     int round_up)
+{
+	long secs = tv->tv_sec - w->base.tv_sec;
+	long usecs = tv->tv_usec - w->base.tv_usec;
+
+	if (usecs < 0) {
+		usecs += 1000000;
+		secs--;
+	}
+	if (secs < 0)
+		return 0;
+
+	if (round_up)
+		usecs += TW_TICK_USECS - 1;
+
+	return (unsigned long)secs * TW_TICKS_PER_SEC + usecs / TW_TICK_USECS;
+}
+
+static void tw_tick_to_timeval(struct timer_wheel *w, unsigned long tick,
+			       struct timeval *tv)
+{
+	*tv = w->base;
+	tv->tv_sec += tick / TW_TICKS_PER_SEC;
+	timeval_add_usecs(tv, (tick % TW_TICKS_PER_SEC) * TW_TICK_USECS);
+}
+
+/* Put a timer in the slot of the level that covers its expiry. The wheel
+ * must be locked. */
+static void __tw_add(struct timer_wheel *w, struct tw_timer *t)
+{
+	long delta = (long)(t->expires - w->tick);
+	list_t *head;
+	int i;
+
+	if (delta < 0) {
+		/* Already expired, run on the next tick */
+		head = &w->root[w->tick & TW_ROOT_MASK];
+	} else if (delta < TW_ROOT_SIZE) {
+		head = &w->root[t->expires & TW_ROOT_MASK];
+	} else {
+		if ((unsigned long)delta > TW_MAX_TICKS) {
+			t->expires = w->tick + TW_MAX_TICKS;
+			delta = TW_MAX_TICKS;
+		}
+		for (i = 0; i < TW_LEVELS - 1; i++)
+			if ((unsigned long)delta <
+			    1UL << (TW_ROOT_BITS + (i + 1) * TW_LEVEL_BITS))
+				break;
+
+		head = &w->levels[i][(t->expires >>
+				      (TW_ROOT_BITS + i * TW_LEVEL_BITS)) &
+				     TW_LEVEL_MASK];
+	}
+	list_add_tail(&t->l, head);
+}
+
+/* Move the timers of the current slot of an upper level down to the levels
+ * below. Returns the slot index, which is 0 when the level wrapped and the
+ * next level up should cascade as well. */
+static int __tw_cascade(struct timer_wheel *w, int level)
+{
+	int idx = (w->tick >> (TW_ROOT_BITS + level * TW_LEVEL_BITS)) &
+	    TW_LEVEL_MASK;
+	list_t tmp, *pos, *n;
+
+	INIT_LIST_HEAD(&tmp);
+	list_splice_init(&w->levels[level][idx], &tmp);
+
+	list_for_each_safe(pos, n, &tmp) {
+		struct tw_timer *t = (struct tw_timer *)pos;
+
+		list_del(&t->l);
+		__tw_add(w, t);
+	}
+	return idx;
+}
+
+/* Set the driver timer for a tick, unless it is already set for an earlier
+ * one. The wheel must be locked. */
+void NSCLASS __tw_arm(unsigned long tick)
+{
+	struct timeval expires;
+
+	/* Never sleep past the next cascade */
+	if ((long)(tick - ((tw.tick | TW_ROOT_MASK) + 1)) > 0)
+		tick = (tw.tick | TW_ROOT_MASK) + 1;
+
+	if (tw.armed && (long)(tick - tw.next) >= 0)
+		return;
+
+	tw.next = tick;
+	tw.armed = 1;
+
+	tw_tick_to_timeval(&tw, tick, &expires);
+	set_hr_timer(&tw_driver, &expires);
+}
+
+void NSCLASS timer_wheel_run(unsigned long data)
+{
+	struct timeval now;
+	unsigned long target;
+	int i;
+
+	gettime(&now);
+
+	spin_lock_bh(&tw.lock);
+
+	tw.armed = 0;
+	target = tw_tick(&tw, &now, 0);
+
+	while ((long)(target - tw.tick) >= 0) {
+		int idx = tw.tick & TW_ROOT_MASK;
+		list_t work;
+
+		if (idx == 0)
+			for (i = 0; i < TW_LEVELS; i++)
+				if (__tw_cascade(&tw, i) != 0)
+					break;
+
+		INIT_LIST_HEAD(&work);
+		list_splice_init(&tw.root[idx], &work);
+
+		/* Timers set from a handler go to later ticks */
+		tw.tick++;
+
+		while (!list_empty(&work)) {
+			struct tw_timer *t = (struct tw_timer *)work.next;
+			tw_fct_t function = t->function;
+			unsigned long data = t->data;
+
+			list_del_init(&t->l);
+			tw.count--;
+			tw.running = t;
+
+			spin_unlock_bh(&tw.lock);
+#ifdef NS2
+			(this->*function) (data);
+#else
+			function(data);
+#endif
+			spin_lock_bh(&tw.lock);
+
+			tw.running = NULL;
+		}
+	}
+
+	if (tw.count) {
+		unsigned long tick = tw.tick;
+
+		/* Find the next tick with work before the next cascade */
+		while ((tick & TW_ROOT_MASK) &&
+		       list_empty(&tw.root[tick & TW_ROOT_MASK]))
+			tick++;
+
+		__tw_arm(tick);
+	}
+	spin_unlock_bh(&tw.lock);
+}
+
+void NSCLASS tw_timer_set(struct tw_timer *t, struct timeval *expires)
+{
+	spin_lock_bh(&tw.lock);
+
+	/* An empty wheel has not been ticking, so catch up with the time
+	 * instead of running through all the empty slots later */
+	if (tw.count == 0) {
+		struct timeval now;
+
+		gettime(&now);
+		tw.tick = tw_tick(&tw, &now, 0);
+	}
+
+	if (tw_timer_pending(t))
+		list_del(&t->l);
+	else
+		tw.count++;
+
+	t->expires = tw_tick(&tw, expires, 1);
+
+	__tw_add(&tw, t);
+	__tw_arm(t->expires);
+
+	spin_unlock_bh(&tw.lock);
+}
+
+int NSCLASS tw_timer_del(struct tw_timer *t)
+{
+	int res = 0;
+
+	spin_lock_bh(&tw.lock);
+
+	if (tw_timer_pending(t)) {
+		list_del_init(&t->l);
+		tw.count--;
+		res = 1;
+	}
+	spin_unlock_bh(&tw.lock);
+
+	return res;
+}
+
+/* Cancel a timer and wait for its handler to finish, if it is running.
+ * Must not be called from the handler itself. */
+void NSCLASS tw_timer_del_sync(struct tw_timer *t)
+{
+	tw_timer_del(t);
+#ifdef __KERNEL__
+	while (*(struct tw_timer * volatile *)&tw.running == t)
+		cpu_relax();
+#endif
+}
+
+int NSCLASS timer_wheel_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < TW_ROOT_SIZE; i++)
+		INIT_LIST_HEAD(&tw.root[i]);
+
+	for (i = 0; i < TW_LEVELS; i++)
+		for (j = 0; j < TW_LEVEL_SIZE; j++)
+			INIT_LIST_HEAD(&tw.levels[i][j]);
+
+	tw.tick = 0;
+	tw.next = 0;
+	tw.armed = 0;
+	tw.count = 0;
+	tw.running = NULL;
+	gettime(&tw.base);
+	spin_lock_init(&tw.lock);
+
+	hr_timer_init(&tw_driver);
+	tw_driver.function = &NSCLASS timer_wheel_run;
+	tw_driver.data = 0;
+
+	return 0;
+}
+
+void NSCLASS timer_wheel_cleanup(void)
+{
+#ifdef NS2
+	if (timer_pending(&tw_driver))
+		del_timer(&tw_driver);
+#else
+	hr_timer_del_sync(&tw_driver);
+#endif
+
+	if (tw.count)
+		LOG_DBG("%u timers still pending\n", tw.count);
+}
@@ -0,0 +1,88 @@
+/* Copyright (C) Uppsala University
+ *
+ * This file is distributed under the terms of the GNU general Public
+ * License (GPL), see the file LICENSE
+ *
+ * Author: Erik Nordström, <erikn@it.uu.se>
+ */
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include "dsr.h"
+#include "tbl.h"
+#include "timer.h"
+
+#ifndef NO_GLOBALS
+
+/* The wheel advances in ticks of one millisecond. The root level covers the
+ * next 256 ticks. Each of the upper levels covers 64 times the span of the
+ * level below, so that timers up to about 18 hours away can be held. */
+#define TW_TICK_USECS 1000
+#define TW_TICKS_PER_SEC (1000000 / TW_TICK_USECS)
+
+#define TW_ROOT_BITS 8
+#define TW_LEVEL_BITS 6
+#define TW_LEVELS 3
+#define TW_ROOT_SIZE (1 << TW_ROOT_BITS)
+#define TW_LEVEL_SIZE (1 << TW_LEVEL_BITS)
+#define TW_ROOT_MASK (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_MASK (TW_LEVEL_SIZE - 1)
+#define TW_MAX_TICKS ((1UL << (TW_ROOT_BITS + TW_LEVELS * TW_LEVEL_BITS)) - 1)
+
+#ifdef NS2
+typedef fct_t tw_fct_t;
+#else
+typedef void (*tw_fct_t) (unsigned long data);
+#endif
+
+/* A timer on the wheel. It is embedded in the object that it times, so
+ * arming it never allocates. */
+struct tw_timer {
+	list_t l;
+	unsigned long expires;	/* In ticks */
+	tw_fct_t function;
+	unsigned long data;
+};
+
+struct timer_wheel {
+	list_t root[TW_ROOT_SIZE];
+	list_t levels[TW_LEVELS][TW_LEVEL_SIZE];
+	unsigned long tick;	/* Next tick to run */
+	unsigned long next;	/* Tick that the driver timer is set for */
+	int armed;
+	unsigned int count;	/* Pending timers */
+	struct timeval base;	/* Time of tick 0 */
+	struct tw_timer *running;
+	spinlock_t lock;
+};
+
+static inline void tw_timer_init(struct tw_timer *t, tw_fct_t function,
+				 unsigned long data)
+{
+	INIT_LIST_HEAD(&t->l);
+	t->expires = 0;
+	t->function = function;
+	t->data = data;
+}
+
+static inline int tw_timer_pending(struct tw_timer *t)
+{
+	return !list_empty(&t->l);
+}
+
+#endif				/* NO_GLOBALS */
+
+#ifndef NO_DECLS
+
+void tw_timer_set(struct tw_timer *t, struct timeval *expires);
+int tw_timer_del(struct tw_timer *t);
+void __tw_arm(unsigned long tick);
+void tw_timer_del_sync(struct tw_timer *t);
+void timer_wheel_run(unsigned long data);
+
+int timer_wheel_init(void);
+void timer_wheel_cleanup(void);
+
+#endif				/* NO_DECLS */
+
+#endif				/* _TIMER_WHEEL_H */
@@ -69,16 +69,55 @@ static inline void gettime(struct timeval *tv)
 	tv->tv_usec = (long)usecs;
 }
 
+/* There is no separate high resolution timer in the simulator */
+typedef DSRUUTimer DSRUUHrTimer;
+
 #else
 
+#include <linux/version.h>
 #include <linux/timer.h>
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,21)
+#define DSR_HRTIMERS
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#endif
+
 typedef struct timer_list DSRUUTimer;
 
+static inline void gettime(struct timeval *tv)
+{
+	if (!tv)
+		return;
+#ifdef DSR_HRTIMERS
+	/* Monotonic time at clock source resolution, not rounded to jiffies,
+	 * so that one hop RTTs can be measured */
+	*tv = ktime_to_timeval(ktime_get());
+#elif defined(KERNEL26)
+	jiffies_to_timeval(jiffies, tv);
+#else
+	tv->tv_sec = jiffies / HZ;
+
+	tv->tv_usec = (jiffies % HZ) * 1000000l / HZ;
+#endif
+}
+
 static inline void set_timer(DSRUUTimer * t, struct timeval *expires)
 {
 	unsigned long exp_jiffies;
-#ifdef KERNEL26
+#ifdef DSR_HRTIMERS
+	/* The time base is not jiffies, so convert relative to now */
+	struct timeval now;
+	long usecs;
+
+	gettime(&now);
+
+	usecs = (expires->tv_sec - now.tv_sec) * 1000000 +
+	    expires->tv_usec - now.tv_usec;
+
+	exp_jiffies = jiffies + (usecs > 0 ? usecs_to_jiffies(usecs) : 0);
+#elif defined(KERNEL26)
 	exp_jiffies = timeval_to_jiffies(expires);
 #else
 	/* Hmm might overlflow? */
@@ -95,20 +134,76 @@ static inline void set_timer(DSRUUTimer * t, struct timeval *expires)
 	}
 }
 
-static inline void gettime(struct timeval *tv)
+#ifdef DSR_HRTIMERS
+/* High resolution timers for the short timeouts where a jiffy is too coarse
+ * (ACK retransmission, RREQ backoff and broadcast jitter). The hrtimer fires
+ * in hard irq context, so the handler is run from a tasklet, where it may
+ * take bh locks and transmit, just like a timer_list handler. */
+typedef struct dsr_hrtimer {
+	struct hrtimer timer;
+	struct tasklet_struct tasklet;
+	void (*function) (unsigned long);
+	unsigned long data;
+} DSRUUHrTimer;
+
+static inline void hr_timer_tasklet(unsigned long data)
 {
-	unsigned long now = jiffies;
+	DSRUUHrTimer *t = (DSRUUHrTimer *) data;
 
-	if (!tv)
-		return;
-#ifdef KERNEL26
-	jiffies_to_timeval(now, tv);
-#else
-	tv->tv_sec = now / HZ;
+	t->function(t->data);
+}
 
-	tv->tv_usec = (now % HZ) * 1000000l / HZ;
-#endif
+static inline enum hrtimer_restart hr_timer_expire(struct hrtimer *timer)
+{
+	DSRUUHrTimer *t = container_of(timer, DSRUUHrTimer, timer);
+
+	tasklet_schedule(&t->tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+static inline void hr_timer_init(DSRUUHrTimer * t)
+{
+	hrtimer_init(&t->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	t->timer.function = hr_timer_expire;
+	tasklet_init(&t->tasklet, hr_timer_tasklet, (unsigned long)t);
+}
+
+static inline int hr_timer_pending(DSRUUHrTimer * t)
+{
+	return hrtimer_active(&t->timer);
 }
+
+static inline int hr_timer_del(DSRUUHrTimer * t)
+{
+	return hrtimer_try_to_cancel(&t->timer) == 1;
+}
+
+static inline int hr_timer_del_sync(DSRUUHrTimer * t)
+{
+	int res = hrtimer_cancel(&t->timer);
+
+	tasklet_kill(&t->tasklet);
+
+	return res;
+}
+
+/* Expiry times come from gettime(), i.e., CLOCK_MONOTONIC */
+static inline void set_hr_timer(DSRUUHrTimer * t, struct timeval *expires)
+{
+	hrtimer_start(&t->timer,
+		      ktime_set(expires->tv_sec, expires->tv_usec * 1000),
+		      HRTIMER_MODE_ABS);
+}
+#else
+typedef DSRUUTimer DSRUUHrTimer;
+
+#define hr_timer_init(t) init_timer(t)
+#define hr_timer_pending(t) timer_pending(t)
+#define hr_timer_del(t) del_timer(t)
+#define hr_timer_del_sync(t) del_timer_sync(t)
+#define set_hr_timer(t, expires) set_timer(t, expires)
+#endif				/* DSR_HRTIMERS */
 #endif				/* NS2 */
 
 static inline char *print_timeval(struct timeval *tv)